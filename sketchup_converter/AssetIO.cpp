@@ -7,8 +7,467 @@
 //
 
 #include "AssetIO.hpp"
+#include "Parallel.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 
 namespace trisetra {
   
+  BlockWriter::BlockWriter(const std::string& file_path, size_t block_size)
+  : _block(block_size), _pending(block_size){
+    _file = std::fopen(file_path.c_str(), "wb");
+    if(!_file)
+      throw std::runtime_error("BlockWriter failed to open: " + file_path);
+    // blocks are already large, skip the stdio copy
+    std::setvbuf(_file, nullptr, _IONBF, 0);
+    _thread = std::thread(&BlockWriter::run, this);
+  }
+  
+  BlockWriter::~BlockWriter(){
+    try{
+      close();
+    } catch(...){
+    }
+  }
+  
+  void BlockWriter::write(const void* data, size_t size){
+    const char* src = (const char*)data;
+    while(size > 0){
+      size_t n = std::min(size, _block.size() - _used);
+      std::memcpy(&_block[_used], src, n);
+      _used += n;
+      src += n;
+      size -= n;
+      if(_used == _block.size())
+        flush_block();
+    }
+  }
+  
+  char* BlockWriter::reserve(size_t size){
+    if(_block.size() - _used < size)
+      flush_block();
+    char* dst = &_block[_used];
+    _used += size;
+    return dst;
+  }
+  
+  void BlockWriter::close(){
+    if(!_file)
+      return;
+    if(_used > 0)
+      flush_block();
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _done = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+    std::fclose(_file);
+    _file = nullptr;
+    if(_failed)
+      throw std::runtime_error("BlockWriter failed to write");
+  }
+  
+  void BlockWriter::flush_block(){
+    std::unique_lock<std::mutex> lock(_mutex);
+    // at most one block in flight, wait for the disk thread to hand back its buffer
+    _cv.wait(lock, [this]{ return !_has_pending; });
+    std::swap(_block, _pending);
+    _pending_size = _used;
+    _total += _used;
+    _used = 0;
+    _has_pending = true;
+    lock.unlock();
+    _cv.notify_all();
+  }
+  
+  void BlockWriter::run(){
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(true){
+      _cv.wait(lock, [this]{ return _has_pending || _done; });
+      if(!_has_pending)
+        break;
+      lock.unlock();
+      bool ok = std::fwrite(_pending.data(), 1, _pending_size, _file) == _pending_size;
+      lock.lock();
+      _failed = _failed || !ok;
+      _has_pending = false;
+      _cv.notify_all();
+    }
+  }
+  
+  size_t vertex_stride(VertexFormat format){
+    switch(format){
+      case VertexFormat::Quantized12: return 12;
+      case VertexFormat::Quantized16: return 16;
+      default: return sizeof(TriVertex);
+    }
+  }
+  
+  MappedFile::MappedFile(const std::string& file_path, Access access){
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if(fd < 0)
+      throw std::runtime_error("MappedFile failed to open: " + file_path);
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || st.st_size == 0){
+      ::close(fd);
+      throw std::runtime_error("MappedFile empty or unreadable: " + file_path);
+    }
+    _size = (size_t)st.st_size;
+    
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if(access == Access::Prefault)
+      flags |= MAP_POPULATE;
+#endif
+    void* data = ::mmap(nullptr, _size, PROT_READ, flags, fd, 0);
+    // the mapping holds its own reference to the file
+    ::close(fd);
+    if(data == MAP_FAILED)
+      throw std::runtime_error("MappedFile failed to map: " + file_path);
+    _data = (const char*)data;
+    
+    if(access == Access::Sequential)
+      ::madvise(data, _size, MADV_SEQUENTIAL);
+    if(access == Access::Prefault){
+#ifndef MAP_POPULATE
+      ::madvise(data, _size, MADV_WILLNEED);
+      long page = ::sysconf(_SC_PAGESIZE);
+      volatile char sink = 0;
+      for(size_t i = 0; i < _size; i += (size_t)page)
+        sink ^= _data[i];
+      (void)sink;
+#endif
+    }
+  }
+  
+  MappedFile::~MappedFile(){
+    if(_data)
+      ::munmap((void*)_data, _size);
+  }
+  
+  TriReader::TriReader(const std::string& file_path, Access access)
+  : _path(file_path), _file(file_path, access), _data(_file.data()), _size(_file.size()){
+    if(_size < 8)
+      throw std::runtime_error("TriReader file too small: " + file_path);
+    if(std::memcmp(_data, "TRIS", 4) == 0)
+      parse_v1();
+    else if(std::memcmp(_data, "TRI2", 4) == 0)
+      parse_v2();
+    else
+      throw std::runtime_error("TriReader unknown tag: " + file_path);
+  }
+  
+  ArrayView<TriVertex> TriReader::vertices(const TriMeshView& mesh) const{
+    ArrayView<TriVertex> view;
+    if(_format == VertexFormat::Float32){
+      view.data = (const TriVertex*)mesh.vertex_data.data;
+      view.size = mesh.vertex_count;
+    }
+    return view;
+  }
+  
+  const char* TriReader::take(size_t& offset, size_t size, size_t alignment) const{
+    if(offset % alignment != 0 || size > _size || offset > _size - size)
+      throw std::runtime_error("TriReader truncated or misaligned block: " + _path);
+    const char* block = _data + offset;
+    offset += size;
+    return block;
+  }
+  
+  template<typename T>
+  T TriReader::take_value(size_t& offset) const{
+    T value;
+    std::memcpy(&value, take(offset, sizeof(T), 1), sizeof(T));
+    return value;
+  }
+  
+  // 'T','R','I','S', uint32 float_count, floats, uint32 index_count, uint32 indices
+  void TriReader::parse_v1(){
+    _version = 1;
+    size_t offset = 4;
+    size_t float_count = take_value<uint32_t>(offset);
+    if(float_count % 8 != 0)
+      throw std::runtime_error("TriReader vertex block is not a multiple of 8 floats: " + _path);
+    
+    TriMeshView mesh;
+    mesh.vertex_count = float_count/8;
+    mesh.vertex_data.data = take(offset, float_count*sizeof(float), sizeof(float));
+    mesh.vertex_data.size = float_count*sizeof(float);
+    size_t index_count = take_value<uint32_t>(offset);
+    mesh.indices32.data = (const uint32_t*)take(offset, index_count*sizeof(uint32_t), sizeof(uint32_t));
+    mesh.indices32.size = index_count;
+    if(offset != _size)
+      throw std::runtime_error("TriReader trailing bytes: " + _path);
+    _meshes.push_back(mesh);
+  }
+  
+  // see MeshImporter::serialize_instanced for the layout
+  void TriReader::parse_v2(){
+    _version = 2;
+    size_t offset = 4;
+    size_t mesh_count = take_value<uint32_t>(offset);
+    size_t node_count = take_value<uint32_t>(offset);
+    uint32_t format = take_value<uint32_t>(offset);
+    if(format > (uint32_t)VertexFormat::Quantized16)
+      throw std::runtime_error("TriReader unknown vertex format: " + _path);
+    _format = (VertexFormat)format;
+    size_t material_count = take_value<uint32_t>(offset);
+    size_t stride = vertex_stride(_format);
+    
+    // every mesh takes at least its 12 byte header, reject absurd counts before reserving
+    if(mesh_count > (_size - offset)/12)
+      throw std::runtime_error("TriReader mesh count exceeds file size: " + _path);
+    _meshes.reserve(mesh_count);
+    for(size_t m = 0; m < mesh_count; ++m){
+      TriMeshView mesh;
+      mesh.vertex_count = take_value<uint32_t>(offset);
+      size_t index_count = take_value<uint32_t>(offset);
+      mesh.index_width = take_value<uint32_t>(offset);
+      if(mesh.index_width != sizeof(uint16_t) && mesh.index_width != sizeof(uint32_t))
+        throw std::runtime_error("TriReader bad index width: " + _path);
+      if(_format != VertexFormat::Float32){
+        std::memcpy(mesh.pos_offset, take(offset, sizeof(mesh.pos_offset), 1), sizeof(mesh.pos_offset));
+        std::memcpy(mesh.pos_extent, take(offset, sizeof(mesh.pos_extent), 1), sizeof(mesh.pos_extent));
+      }
+      mesh.vertex_data.size = mesh.vertex_count*stride;
+      mesh.vertex_data.data = take(offset, mesh.vertex_data.size, sizeof(uint32_t));
+      
+      size_t index_bytes = index_count*mesh.index_width;
+      const char* indices = take(offset, index_bytes, sizeof(uint32_t));
+      take(offset, (4 - index_bytes % 4) % 4, 1);
+      if(mesh.index_width == sizeof(uint16_t))
+        mesh.indices16 = {(const uint16_t*)indices, index_count};
+      else
+        mesh.indices32 = {(const uint32_t*)indices, index_count};
+      
+      size_t range_count = take_value<uint32_t>(offset);
+      if(range_count > (_size - offset)/sizeof(DrawRange))
+        throw std::runtime_error("TriReader truncated or misaligned block: " + _path);
+      mesh.ranges.data = (const DrawRange*)take(offset, range_count*sizeof(DrawRange), sizeof(uint32_t));
+      mesh.ranges.size = range_count;
+      for(const DrawRange& range : mesh.ranges){
+        if(range.first_index > index_count || range.index_count > index_count - range.first_index)
+          throw std::runtime_error("TriReader draw range out of bounds: " + _path);
+      }
+      _meshes.push_back(mesh);
+    }
+    
+    _nodes.data = (const TriNode*)take(offset, node_count*sizeof(TriNode), sizeof(uint32_t));
+    _nodes.size = node_count;
+    
+    auto take_string = [&](std::string& value){
+      size_t length = take_value<uint32_t>(offset);
+      const char* bytes = take(offset, length, 1);
+      value.assign(bytes, length);
+      take(offset, (4 - length % 4) % 4, 1);
+    };
+    // every material takes at least 28 bytes
+    if(material_count > (_size - offset)/28)
+      throw std::runtime_error("TriReader material count exceeds file size: " + _path);
+    _materials.resize(material_count);
+    for(TriMaterial& material : _materials){
+      std::memcpy(material.base_color, take(offset, sizeof(material.base_color), 1), sizeof(material.base_color));
+      material.opacity = take_value<float>(offset);
+      take_string(material.name);
+      take_string(material.base_color_map);
+    }
+    if(offset != _size)
+      throw std::runtime_error("TriReader trailing bytes: " + _path);
+  }
+  
+  static_assert(sizeof(AssetIO::ChunkEntry) == 40, "ChunkEntry is written as is");
+  const uint32_t AssetIO::version;
+  static const size_t asset_footer_size = 2*sizeof(uint64_t) + 2*sizeof(uint32_t);
+  
+  uint32_t AssetIO::checksum(const void* data, size_t size){
+    uLong crc = crc32(0L, Z_NULL, 0);
+    const Bytef* bytes = (const Bytef*)data;
+    // crc32 takes 32 bit lengths
+    while(size > 0){
+      uInt n = (uInt)std::min(size, (size_t)(1u << 30));
+      crc = crc32(crc, bytes, n);
+      bytes += n;
+      size -= n;
+    }
+    return (uint32_t)crc;
+  }
+  
+  AssetIO::PackedChunk AssetIO::pack(ChunkType type, uint32_t index, std::vector<char>&& raw, Compression compression){
+    PackedChunk chunk;
+    chunk.entry.type = type;
+    chunk.entry.index = index;
+    chunk.entry.compression = Compression::None;
+    chunk.entry.checksum = checksum(raw.data(), raw.size());
+    chunk.entry.offset = 0;
+    chunk.entry.raw_size = raw.size();
+    
+    if(compression == Compression::Deflate && !raw.empty()){
+      uLongf stored_size = compressBound((uLong)raw.size());
+      chunk.stored.resize(stored_size);
+      if(compress2((Bytef*)chunk.stored.data(), &stored_size, (const Bytef*)raw.data(), (uLong)raw.size(), Z_DEFAULT_COMPRESSION) == Z_OK &&
+         stored_size < raw.size()){
+        chunk.stored.resize(stored_size);
+        chunk.entry.compression = Compression::Deflate;
+      }
+    }
+    if(chunk.entry.compression == Compression::None)
+      chunk.stored = std::move(raw);
+    chunk.entry.stored_size = chunk.stored.size();
+    return chunk;
+  }
+  
+  AssetWriter::AssetWriter(const std::string& file_path) : _file(file_path){
+    _file.write("TRSA", 4);
+    _file.write_value(AssetIO::version);
+  }
+  
+  void AssetWriter::write(const AssetIO::PackedChunk& chunk){
+    AssetIO::ChunkEntry entry = chunk.entry;
+    entry.offset = _file.position();
+    _file.write(chunk.stored.data(), chunk.stored.size());
+    const char zero[8] = {};
+    _file.write(zero, (8 - chunk.stored.size() % 8) % 8);
+    _toc.push_back(entry);
+  }
+  
+  void AssetWriter::close(){
+    uint64_t toc_offset = _file.position();
+    _file.write(_toc.data(), _toc.size()*sizeof(AssetIO::ChunkEntry));
+    _file.write_value(toc_offset);
+    _file.write_value((uint64_t)_toc.size());
+    _file.write_value(AssetIO::version);
+    _file.write("TRSA", 4);
+    _file.close();
+  }
+  
+  AssetReader::AssetReader(const std::string& file_path, MappedFile::Access access)
+  : _path(file_path), _file(file_path, access){
+    const char* data = _file.data();
+    size_t size = _file.size();
+    if(size < 8 + asset_footer_size || std::memcmp(data, "TRSA", 4) != 0 || std::memcmp(data + size - 4, "TRSA", 4) != 0)
+      throw std::runtime_error("AssetReader not a container: " + file_path);
+    
+    uint64_t toc_offset, chunk_count;
+    uint32_t file_version;
+    const char* footer = data + size - asset_footer_size;
+    std::memcpy(&toc_offset, footer, sizeof(uint64_t));
+    std::memcpy(&chunk_count, footer + sizeof(uint64_t), sizeof(uint64_t));
+    std::memcpy(&file_version, footer + 2*sizeof(uint64_t), sizeof(uint32_t));
+    if(file_version > AssetIO::version)
+      throw std::runtime_error("AssetReader unsupported version: " + file_path);
+    
+    size_t toc_end = size - asset_footer_size;
+    if(toc_offset < 8 || toc_offset > toc_end || chunk_count != (toc_end - toc_offset)/sizeof(AssetIO::ChunkEntry) ||
+       (toc_end - toc_offset) % sizeof(AssetIO::ChunkEntry) != 0)
+      throw std::runtime_error("AssetReader bad table of contents: " + file_path);
+    
+    _toc.resize(chunk_count);
+    std::memcpy(_toc.data(), data + toc_offset, chunk_count*sizeof(AssetIO::ChunkEntry));
+    for(const AssetIO::ChunkEntry& entry : _toc){
+      if(entry.offset < 8 || entry.offset > toc_offset || entry.stored_size > toc_offset - entry.offset ||
+         (entry.compression == AssetIO::Compression::None && entry.stored_size != entry.raw_size) ||
+         (uint32_t)entry.compression > (uint32_t)AssetIO::Compression::Deflate)
+        throw std::runtime_error("AssetReader chunk out of bounds: " + file_path);
+    }
+  }
+  
+  const AssetIO::ChunkEntry* AssetReader::find(AssetIO::ChunkType type, uint32_t index) const{
+    for(const AssetIO::ChunkEntry& entry : _toc){
+      if(entry.type == type && entry.index == index)
+        return &entry;
+    }
+    return nullptr;
+  }
+  
+  ArrayView<char> AssetReader::stored(const AssetIO::ChunkEntry& entry) const{
+    return {_file.data() + entry.offset, (size_t)entry.stored_size};
+  }
+  
+  std::vector<char> AssetReader::read(const AssetIO::ChunkEntry& entry) const{
+    ArrayView<char> src = stored(entry);
+    std::vector<char> raw;
+    if(entry.compression == AssetIO::Compression::None){
+      raw.assign(src.begin(), src.end());
+    } else {
+      raw.resize(entry.raw_size);
+      uLongf raw_size = (uLongf)entry.raw_size;
+      if(uncompress((Bytef*)raw.data(), &raw_size, (const Bytef*)src.data, (uLong)src.size) != Z_OK || raw_size != entry.raw_size)
+        throw std::runtime_error("AssetReader failed to inflate chunk: " + _path);
+    }
+    if(AssetIO::checksum(raw.data(), raw.size()) != entry.checksum)
+      throw std::runtime_error("AssetReader checksum mismatch: " + _path);
+    return raw;
+  }
+  
+  std::vector<std::vector<char>> AssetReader::read(const std::vector<const AssetIO::ChunkEntry*>& entries) const{
+    std::vector<std::vector<char>> result(entries.size());
+    std::vector<std::string> errors(entries.size());
+    parallel_for(entries.size(), [&](size_t i){
+      try{
+        result[i] = read(*entries[i]);
+      } catch(const std::exception& e){
+        errors[i] = e.what();
+      }
+    });
+    for(const std::string& error : errors){
+      if(!error.empty())
+        throw std::runtime_error(error);
+    }
+    return result;
+  }
+  
+  static void put_be32(std::vector<uint8_t>& out, uint32_t value){
+    uint8_t bytes[4] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+    out.insert(out.end(), bytes, bytes + 4);
+  }
+  
+  static void put_png_chunk(std::vector<uint8_t>& out, const char type[4], const uint8_t* data, size_t size){
+    put_be32(out, (uint32_t)size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_be32(out, AssetIO::checksum(out.data() + start, out.size() - start));
+  }
+  
+  bool write_png(const std::string& path, uint32_t width, uint32_t height, const uint8_t* rgba){
+    if(width == 0 || height == 0 || width > (1u << 24) || height > (1u << 24))
+      return false;
+    // every row starts with filter type 0 (none), deflate does the work
+    size_t row = (size_t)width * 4;
+    std::vector<uint8_t> raw((row + 1) * height);
+    for(uint32_t y = 0; y < height; ++y){
+      raw[y*(row + 1)] = 0;
+      std::memcpy(&raw[y*(row + 1) + 1], rgba + y*row, row);
+    }
+    uLongf deflated_size = compressBound((uLong)raw.size());
+    std::vector<uint8_t> deflated(deflated_size);
+    if(compress2(deflated.data(), &deflated_size, raw.data(), (uLong)raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+      return false;
+    
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<uint8_t> header;
+    put_be32(header, width);
+    put_be32(header, height);
+    header.insert(header.end(), {8, 6, 0, 0, 0});  // 8 bit depth, RGBA, deflate, adaptive filter, no interlace
+    
+    std::vector<uint8_t> png(signature, signature + sizeof(signature));
+    png.reserve(deflated_size + 64);
+    put_png_chunk(png, "IHDR", header.data(), header.size());
+    put_png_chunk(png, "IDAT", deflated.data(), deflated_size);
+    put_png_chunk(png, "IEND", nullptr, 0);
+    
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if(!file)
+      return false;
+    bool ok = std::fwrite(png.data(), 1, png.size(), file) == png.size();
+    return std::fclose(file) == 0 && ok;
+  }
 }
@@ -10,16 +10,262 @@
 #define TRISETRA_ASSET_IO_HPP
 
 #include "MeshImport.h"
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 namespace trisetra {
   
-  // data carrier
+  enum class VertexFormat : uint32_t{
+    Float32 = 0,      // float3 pos, float3 normal, float2 uv (32 bytes)
+    Quantized12 = 1,  // unorm16x3 pos, octahedral unorm8x2 normal, half2 uv (12 bytes)
+    Quantized16 = 2,  // unorm16x4 pos (w unused), octahedral unorm16x2 normal, half2 uv (16 bytes)
+  };
+  
+  size_t vertex_stride(VertexFormat format);
+  
+  // binary output stream that fills fixed size blocks and hands full blocks to a background
+  // thread, so the caller keeps producing data while the previous block goes to disk.
+  // every block is written with a single unbuffered fwrite.
+  class BlockWriter{
+  public:
+    explicit BlockWriter(const std::string& file_path, size_t block_size = 4 << 20);
+    ~BlockWriter();
+    
+    void write(const void* data, size_t size);
+    template<typename T>
+    void write_value(const T& value){ write(&value, sizeof(T)); }
+    // contiguous space for size bytes in the current block, size must not exceed the block size
+    char* reserve(size_t size);
+    // flushes the last block and waits for the disk thread, throws if any write failed
+    void close();
+    
+    size_t bytes_written() const { return _total; }
+    // offset of the next byte written
+    size_t position() const { return _total + _used; }
+    
+  protected:
+    void flush_block();
+    void run();
+    
+    std::FILE*              _file = nullptr;
+    std::vector<char>       _block;
+    std::vector<char>       _pending;
+    size_t                  _used = 0;
+    size_t                  _pending_size = 0;
+    size_t                  _total = 0;
+    bool                    _has_pending = false;
+    bool                    _done = false;
+    bool                    _failed = false;
+    std::mutex              _mutex;
+    std::condition_variable _cv;
+    std::thread             _thread;
+  };
+  
+  // read only typed view into a mapped block
+  template<typename T>
+  struct ArrayView{
+    const T* data = nullptr;
+    size_t   size = 0;
+    
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+    const T& operator[](size_t i) const { return data[i]; }
+    bool empty() const { return size == 0; }
+  };
+  
+  // VertexFormat::Float32 vertex
+  struct TriVertex{
+    float pos[3];
+    float normal[3];
+    float uv[2];
+  };
+  
+  struct TriNode{
+    int32_t parent;
+    int32_t mesh;
+    float   local[12];
+  };
+  
+  struct TriMeshView{
+    uint32_t        index_width = sizeof(uint32_t);
+    // quantized formats only, pos = pos_offset + q/65535*pos_extent
+    float           pos_offset[3] = {0.0f, 0.0f, 0.0f};
+    float           pos_extent[3] = {1.0f, 1.0f, 1.0f};
+    // vertex_count * vertex_stride(format) bytes
+    ArrayView<char> vertex_data;
+    size_t          vertex_count = 0;
+    // only one of these is set, depending on index_width
+    ArrayView<uint16_t> indices16;
+    ArrayView<uint32_t> indices32;
+    // v2 only, material sorted
+    ArrayView<DrawRange> ranges;
+    
+    size_t index_count() const { return indices16.size + indices32.size; }
+    uint32_t index(size_t i) const { return indices16.data ? indices16[i] : indices32[i]; }
+  };
+  
+  // read only mapping of a whole file
+  class MappedFile{
+  public:
+    enum class Access{
+      Lazy,        // pages are faulted in on first touch
+      Sequential,  // read ahead hint for a single front to back pass
+      Prefault,    // every page is resident before the constructor returns
+    };
+    
+    MappedFile(const std::string& file_path, Access access);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+    
+  protected:
+    const char* _data = nullptr;
+    size_t      _size = 0;
+  };
+  
+  struct TriMaterial{
+    float       base_color[4];
+    float       opacity;
+    std::string name;
+    std::string base_color_map;
+  };
+  
+  // maps a .tri (v1 'TRIS' or v2 'TRI2') read only and validates the header and every block size,
+  // the views point straight into the mapping and stay valid as long as the reader lives.
+  // a v1 file is exposed as a single Float32 mesh without nodes.
+  class TriReader{
+  public:
+    typedef MappedFile::Access Access;
+    
+    explicit TriReader(const std::string& file_path, Access access = Access::Lazy);
+    
+    uint32_t version() const { return _version; }
+    VertexFormat vertex_format() const { return _format; }
+    const std::vector<TriMeshView>& meshes() const { return _meshes; }
+    ArrayView<TriNode> nodes() const { return _nodes; }
+    // material table the draw ranges index, v2 only
+    const std::vector<TriMaterial>& materials() const { return _materials; }
+    // Float32 meshes only, empty otherwise
+    ArrayView<TriVertex> vertices(const TriMeshView& mesh) const;
+    size_t file_size() const { return _file.size(); }
+    
+  protected:
+    void parse_v1();
+    void parse_v2();
+    // next size bytes of the mapping, throws if the file is shorter
+    const char* take(size_t& offset, size_t size, size_t alignment) const;
+    template<typename T>
+    T take_value(size_t& offset) const;
+    
+    std::string              _path;
+    MappedFile               _file;
+    const char*              _data = nullptr;
+    size_t                   _size = 0;
+    uint32_t                 _version = 0;
+    VertexFormat             _format = VertexFormat::Float32;
+    std::vector<TriMeshView> _meshes;
+    ArrayView<TriNode>       _nodes;
+    std::vector<TriMaterial> _materials;
+  };
+  
+  // chunked asset container (.tra), all little endian:
+  //   'T','R','S','A', uint32 version
+  //   chunks, each starting 8 byte aligned
+  //   table of contents: chunk_count * ChunkEntry
+  //   footer: uint64 toc_offset, uint64 chunk_count, uint32 version, 'T','R','S','A'
+  // the table of contents trails the chunks so they stream out in a single pass
   class AssetIO{
   public:
-    static void serialize( );
-    static void deserialize();
+    static const uint32_t version = 1;
+    
+    // payloads, all sizes and counts little endian uint32 unless noted:
+    //   Vertices (index = mesh): vertex_format, vertex_count, float3 pos_offset, float3 pos_extent, vertices
+    //   Indices  (index = mesh): index_width, index_count, indices padded to 4 bytes
+    //   Nodes:     TriNode per node
+    //   Materials: count, per material float4 base_color, float opacity, string name, string base_color_map
+    //   Textures:  count, per texture string path
+    //   Lods     (index = mesh): level_count, per level float error, index_width, index_count, indices padded to 4 bytes
+    //   DrawRanges (index = mesh): list_count (full mesh, then each lod), per list range_count, DrawRange per range
+    // strings are a uint32 length followed by the bytes
+    enum class ChunkType : uint32_t{
+      Vertices = 1,
+      Indices = 2,
+      Nodes = 3,
+      Materials = 4,
+      Textures = 5,
+      Lods = 6,
+      DrawRanges = 7,
+    };
+    
+    enum class Compression : uint32_t{
+      None = 0,
+      Deflate = 1,
+    };
+    
+    struct ChunkEntry{
+      ChunkType   type;
+      uint32_t    index;
+      Compression compression;
+      uint32_t    checksum;     // crc32 of the uncompressed payload
+      uint64_t    offset;
+      uint64_t    stored_size;
+      uint64_t    raw_size;
+    };
+    
+    // a payload ready for the writer, compressed and checksummed by whichever thread packed it
+    struct PackedChunk{
+      ChunkEntry        entry;
+      std::vector<char> stored;
+    };
+    
+    // falls back to Compression::None when deflate does not shrink the payload
+    static PackedChunk pack(ChunkType type, uint32_t index, std::vector<char>&& raw, Compression compression);
+    static uint32_t checksum(const void* data, size_t size);
+  };
+  
+  class AssetWriter{
+  public:
+    explicit AssetWriter(const std::string& file_path);
+    
+    void write(const AssetIO::PackedChunk& chunk);
+    // writes the table of contents and footer, throws if any write failed
+    void close();
+    
   protected:
+    BlockWriter                        _file;
+    std::vector<AssetIO::ChunkEntry>   _toc;
+  };
+  
+  // maps a container and validates the table of contents, chunks are only touched when read
+  class AssetReader{
+  public:
+    explicit AssetReader(const std::string& file_path, MappedFile::Access access = MappedFile::Access::Lazy);
     
+    const std::vector<AssetIO::ChunkEntry>& chunks() const { return _toc; }
+    // nullptr if there is no such chunk
+    const AssetIO::ChunkEntry* find(AssetIO::ChunkType type, uint32_t index = 0) const;
+    // bytes as stored, a zero copy view of the payload for uncompressed chunks
+    ArrayView<char> stored(const AssetIO::ChunkEntry& entry) const;
+    // decompressed payload, throws on a checksum mismatch
+    std::vector<char> read(const AssetIO::ChunkEntry& entry) const;
+    // decompresses the given chunks in parallel, results in the same order
+    std::vector<std::vector<char>> read(const std::vector<const AssetIO::ChunkEntry*>& entries) const;
+    
+  protected:
+    std::string                        _path;
+    MappedFile                         _file;
+    std::vector<AssetIO::ChunkEntry>   _toc;
   };
+  
+  // writes 8 bit RGBA pixels, tightly packed rows from the top, as a deflated png.
+  // false when the file could not be written
+  bool write_png(const std::string& path, uint32_t width, uint32_t height, const uint8_t* rgba);
 }
 
 
@@ -0,0 +1,377 @@
+//
+//  ConversionCache.cpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#include "ConversionCache.hpp"
+#include "AssetIO.hpp"
+#include "WorkerProcess.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace trisetra {
+
+  ////////////// hash64 //////////////
+
+  static const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+  static const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+  static const uint64_t prime3 = 0x165667B19E3779F9ULL;
+  static const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+  static const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+  static inline uint64_t rotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static inline uint64_t read64(const unsigned char* p){
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static inline uint32_t read32(const unsigned char* p){
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static inline uint64_t hash_round(uint64_t acc, uint64_t input){
+    acc += input*prime2;
+    return rotl(acc, 31)*prime1;
+  }
+
+  static inline uint64_t hash_merge(uint64_t acc, uint64_t value){
+    acc ^= hash_round(0, value);
+    return acc*prime1 + prime4;
+  }
+
+  uint64_t hash64(const void* data, size_t size, uint64_t seed){
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    uint64_t h;
+    if(size >= 32){
+      uint64_t v1 = seed + prime1 + prime2;
+      uint64_t v2 = seed + prime2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - prime1;
+      for(const unsigned char* limit = end - 32; p <= limit; p += 32){
+        v1 = hash_round(v1, read64(p));
+        v2 = hash_round(v2, read64(p + 8));
+        v3 = hash_round(v3, read64(p + 16));
+        v4 = hash_round(v4, read64(p + 24));
+      }
+      h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+      h = hash_merge(h, v1);
+      h = hash_merge(h, v2);
+      h = hash_merge(h, v3);
+      h = hash_merge(h, v4);
+    } else {
+      h = seed + prime5;
+    }
+    h += (uint64_t)size;
+    for(; p + 8 <= end; p += 8){
+      h ^= hash_round(0, read64(p));
+      h = rotl(h, 27)*prime1 + prime4;
+    }
+    if(p + 4 <= end){
+      h ^= (uint64_t)read32(p)*prime1;
+      h = rotl(h, 23)*prime2 + prime3;
+      p += 4;
+    }
+    for(; p < end; ++p){
+      h ^= (*p)*prime5;
+      h = rotl(h, 11)*prime1;
+    }
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  ////////////// files //////////////
+
+  static std::string hex(uint64_t value){
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+    return text;
+  }
+
+  static uint64_t hash_file(const std::string& path, uint64_t size){
+    if(size == 0)
+      return hash64(nullptr, 0);
+    MappedFile file(path, MappedFile::Access::Sequential);
+    return hash64(file.data(), file.size());
+  }
+
+  // clone where the file system can share blocks copy on write, plain copy otherwise
+  static bool copy_file(const std::string& src, const std::string& dst){
+    ::unlink(dst.c_str());
+#ifdef __APPLE__
+    if(::clonefile(src.c_str(), dst.c_str(), 0) == 0)
+      return true;
+#endif
+    int in = ::open(src.c_str(), O_RDONLY);
+    if(in < 0)
+      return false;
+    int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0){
+      ::close(in);
+      return false;
+    }
+    bool copied = false;
+#ifdef FICLONE
+    copied = ::ioctl(out, FICLONE, in) == 0;
+#endif
+    if(!copied){
+      std::vector<char> block(1 << 20);
+      copied = true;
+      for(;;){
+        ssize_t n = ::read(in, block.data(), block.size());
+        if(n < 0 && errno == EINTR)
+          continue;
+        if(n <= 0){
+          copied = n == 0;
+          break;
+        }
+        if(!write_all(out, block.data(), (size_t)n)){
+          copied = false;
+          break;
+        }
+      }
+    }
+    ::close(in);
+    copied = ::close(out) == 0 && copied;
+    if(!copied)
+      ::unlink(dst.c_str());
+    return copied;
+  }
+
+  static void remove_entry(const std::string& dir){
+    if(DIR* handle = ::opendir(dir.c_str())){
+      while(dirent* entry = ::readdir(handle)){
+        std::string name = entry->d_name;
+        if(name != "." && name != "..")
+          ::unlink((dir + "/" + name).c_str());
+      }
+      ::closedir(handle);
+    }
+    ::rmdir(dir.c_str());
+  }
+
+  struct ManifestFile{
+    CachedFile file;
+    uint64_t   size;
+    uint64_t   hash;
+  };
+
+  // names are restored below the output base or the texture directory, never outside them
+  static bool contained(const std::string& name){
+    return ("/" + name + "/").find("/../") == std::string::npos;
+  }
+
+  static bool read_manifest(const std::string& path, size_t& triangles, std::vector<ManifestFile>& files){
+    std::ifstream manifest(path);
+    std::string line;
+    if(!std::getline(manifest, line) || std::sscanf(line.c_str(), "triangles\t%zu", &triangles) != 1)
+      return false;
+    while(std::getline(manifest, line)){
+      unsigned kind = 0;
+      unsigned long long size = 0;
+      unsigned long long hash = 0;
+      int name_start = 0;
+      if(std::sscanf(line.c_str(), "%u\t%llu\t%llx\t%n", &kind, &size, &hash, &name_start) != 3 || name_start == 0 || kind > 1)
+        return false;
+      std::string name = line.substr((size_t)name_start);
+      if(!contained(name))
+        return false;
+      files.push_back({{(CachedFile::Kind)kind, name}, size, hash});
+    }
+    return true;
+  }
+
+  struct StoredEntry{
+    std::string dir;
+    time_t      used;
+    uint64_t    bytes;
+  };
+
+  // every complete entry below root, returns their total size
+  static uint64_t scan_entries(const std::string& root, std::vector<StoredEntry>& entries){
+    uint64_t total = 0;
+    DIR* handle = ::opendir(root.c_str());
+    if(!handle)
+      return 0;
+    while(dirent* item = ::readdir(handle)){
+      std::string name = item->d_name;
+      if(name.size() != 16 || name.find_first_not_of("0123456789abcdef") != std::string::npos)
+        continue;
+      StoredEntry entry{root + "/" + name, 0, 0};
+      struct stat st;
+      if(::stat((entry.dir + "/manifest").c_str(), &st) != 0)
+        continue;
+      entry.used = st.st_mtime;
+      size_t triangles = 0;
+      std::vector<ManifestFile> files;
+      read_manifest(entry.dir + "/manifest", triangles, files);
+      for(const ManifestFile& file : files)
+        entry.bytes += file.size;
+      total += entry.bytes;
+      entries.push_back(entry);
+    }
+    ::closedir(handle);
+    return total;
+  }
+
+  ////////////// ConversionCache //////////////
+
+  ConversionCache::ConversionCache(const std::string& root, uint64_t max_bytes)
+  : _root(root), _max_bytes(max_bytes), _hits(0), _misses(0), _stored(0), _evicted(0){
+    if(::mkdir(root.c_str(), 0755) != 0 && errno != EEXIST)
+      throw std::runtime_error("ConversionCache failed to create " + root);
+  }
+
+  uint64_t ConversionCache::key(const std::string& input_path, const std::string& options_digest){
+    MappedFile input(input_path, MappedFile::Access::Sequential);
+    return hash64(input.data(), input.size(), hash64(options_digest.data(), options_digest.size()));
+  }
+
+  std::string ConversionCache::entry_path(uint64_t key) const{
+    return _root + "/" + hex(key);
+  }
+
+  bool ConversionCache::fetch(uint64_t key, const std::string& output_base, const std::string& texture_dir, CacheEntry& entry){
+    std::string dir = entry_path(key);
+    // entry is only assigned on a hit, a miss part way through leaves it empty for the conversion to fill
+    entry = CacheEntry();
+    CacheEntry restored;
+    std::vector<ManifestFile> files;
+    if(!read_manifest(dir + "/manifest", restored.triangles, files)){
+      ++_misses;
+      return false;
+    }
+    // verified before anything is restored, so a damaged entry leaves no partial outputs behind
+    for(size_t f = 0; f < files.size(); ++f){
+      std::string stored = dir + "/" + std::to_string(f);
+      struct stat st;
+      bool intact = false;
+      try {
+        intact = ::stat(stored.c_str(), &st) == 0 && (uint64_t)st.st_size == files[f].size &&
+                 hash_file(stored, files[f].size) == files[f].hash;
+      } catch (const std::exception&) {
+        // evicted by another process meanwhile
+      }
+      if(!intact){
+        std::cerr << "cache entry " << hex(key) << " failed verification, dropped" << std::endl;
+        remove_entry(dir);
+        ++_misses;
+        return false;
+      }
+    }
+    for(size_t f = 0; f < files.size(); ++f){
+      if(!copy_file(dir + "/" + std::to_string(f), files[f].file.path(output_base, texture_dir))){
+        ++_misses;
+        return false;
+      }
+      restored.files.push_back(files[f].file);
+    }
+    ::utimes((dir + "/manifest").c_str(), nullptr);
+    entry = std::move(restored);
+    ++_hits;
+    return true;
+  }
+
+  void ConversionCache::store(uint64_t key, const std::string& output_base, const std::string& texture_dir, const CacheEntry& entry){
+    static std::atomic<uint32_t> counter(0);
+    std::string temp = _root + "/.tmp." + std::to_string(::getpid()) + "." + std::to_string(counter++);
+    if(::mkdir(temp.c_str(), 0755) != 0)
+      throw std::runtime_error("ConversionCache failed to create " + temp);
+
+    std::ostringstream manifest;
+    manifest << "triangles\t" << entry.triangles << "\n";
+    uint64_t bytes = 0;
+    for(size_t f = 0; f < entry.files.size(); ++f){
+      const CachedFile& file = entry.files[f];
+      std::string stored = temp + "/" + std::to_string(f);
+      struct stat st;
+      if(!copy_file(file.path(output_base, texture_dir), stored) || ::stat(stored.c_str(), &st) != 0){
+        remove_entry(temp);
+        throw std::runtime_error("ConversionCache failed to store " + file.path(output_base, texture_dir));
+      }
+      bytes += (uint64_t)st.st_size;
+      manifest << (uint32_t)file.kind << "\t" << st.st_size << "\t" << hex(hash_file(stored, (uint64_t)st.st_size))
+               << "\t" << file.name << "\n";
+    }
+    // the manifest goes last, an entry without one is never read
+    std::ofstream manifest_file(temp + "/manifest");
+    manifest_file << manifest.str();
+    manifest_file.close();
+    if(!manifest_file || ::rename(temp.c_str(), entry_path(key).c_str()) != 0){
+      // also taken when another conversion stored the same key first
+      remove_entry(temp);
+      return;
+    }
+    ++_stored;
+    evict(bytes);
+  }
+
+  void ConversionCache::evict(uint64_t added_bytes){
+    std::lock_guard<std::mutex> lock(_evict_mutex);
+    if(_total_known){
+      _total_bytes += added_bytes;
+      if(_total_bytes <= _max_bytes)
+        return;
+    }
+    // the first store and every overflow rescan, which also picks up what other processes stored
+    std::vector<StoredEntry> entries;
+    uint64_t total = scan_entries(_root, entries);
+    _total_known = true;
+    if(total <= _max_bytes){
+      _total_bytes = total;
+      return;
+    }
+
+    // down to 90%, so a full cache takes a tenth of max_bytes of new entries before the next scan
+    // instead of rescanning on every store
+    uint64_t low_water = _max_bytes - _max_bytes/10;
+    std::sort(entries.begin(), entries.end(), [](const StoredEntry& a, const StoredEntry& b){ return a.used < b.used; });
+    for(const StoredEntry& entry : entries){
+      if(total <= low_water)
+        break;
+      remove_entry(entry.dir);
+      total -= entry.bytes;
+      ++_evicted;
+    }
+    _total_bytes = total;
+  }
+
+  ConversionCache::Stats ConversionCache::stats() const{
+    Stats stats;
+    stats.hits = _hits;
+    stats.misses = _misses;
+    stats.stored = _stored;
+    stats.evicted = _evicted;
+    return stats;
+  }
+}
@@ -0,0 +1,92 @@
+//
+//  ConversionCache.hpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#ifndef ConversionCache_hpp
+#define ConversionCache_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace trisetra {
+
+  // 64 bit xxHash (XXH64) of size bytes, several GB/s on one core
+  uint64_t hash64(const void* data, size_t size, uint64_t seed = 0);
+
+  // file written by a conversion
+  struct CachedFile{
+    enum class Kind : uint32_t{
+      Output = 0,   // name is the suffix appended to the output base name, e.g. ".tri"
+      Texture = 1,  // name is the texture map path relative to the texture directory, e.g. "./brick_<hash>.png"
+    };
+    Kind        kind;
+    std::string name;
+
+    std::string path(const std::string& output_base, const std::string& texture_dir) const{
+      if(kind == Kind::Output)
+        return output_base + name;
+      return name.compare(0, 2, "./") == 0 ? texture_dir + name.substr(1) : texture_dir + "/" + name;
+    }
+  };
+
+  struct CacheEntry{
+    size_t                  triangles = 0;
+    std::vector<CachedFile> files;
+  };
+
+  // content addressed store of conversion results, one directory per key below root:
+  //   <root>/<key as 16 hex digits>/manifest  tab separated, "triangles" count, then kind, size, hash64, name per file
+  //   <root>/<key>/<n>                         content of the n-th file of the manifest
+  // an entry is built under a temporary name and renamed into place, so it is complete or absent.
+  // a hit refreshes the manifest time, once root exceeds max_bytes the least recently used entries go
+  // until it is back under 90% of it. the size of root is tracked in memory after one scan, only
+  // exceeding max_bytes scans it again.
+  // files are cloned (copy on write) where the file system supports it and copied otherwise, never hard
+  // linked, since a later conversion rewriting an output in place would corrupt the entry
+  class ConversionCache{
+  public:
+    struct Stats{
+      size_t hits = 0;
+      size_t misses = 0;
+      size_t stored = 0;
+      size_t evicted = 0;
+    };
+
+    ConversionCache(const std::string& root, uint64_t max_bytes);
+
+    // key of converting the file at input_path, options_digest spells out every option affecting the output
+    static uint64_t key(const std::string& input_path, const std::string& options_digest);
+
+    // restores every file of key to its CachedFile::path. false on a miss or an entry failing
+    // verification against its manifest hashes, which is then dropped. entry is left empty on a miss
+    bool fetch(uint64_t key, const std::string& output_base, const std::string& texture_dir, CacheEntry& entry);
+    // stores the files of a finished conversion under key, then evicts if root exceeds max_bytes
+    void store(uint64_t key, const std::string& output_base, const std::string& texture_dir, const CacheEntry& entry);
+
+    Stats stats() const;
+
+  protected:
+    std::string entry_path(uint64_t key) const;
+    // accounts for a stored entry of added_bytes and evicts down to 90% once the total exceeds max_bytes
+    void evict(uint64_t added_bytes);
+
+    std::string         _root;
+    uint64_t            _max_bytes;
+    std::mutex          _evict_mutex;
+    // size of all entries, kept up to date from the first store on without rescanning root
+    uint64_t            _total_bytes = 0;
+    bool                _total_known = false;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+    std::atomic<size_t> _stored;
+    std::atomic<size_t> _evicted;
+  };
+}
+
+#endif /* ConversionCache_hpp */
@@ -0,0 +1,206 @@
+//
+//  ConvertService.cpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#include "ConvertService.hpp"
+#include "WorkerProcess.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace trisetra {
+
+  const uint32_t ConvertService::version;
+  const uint64_t ConvertService::default_max_data;
+
+  static const char job_magic[4] = {'T','R','S','J'};
+  // longest name or flag accepted from the other end
+  static const uint32_t max_string = 4096;
+  static const size_t stream_block = 1 << 20;
+
+  static sockaddr_un socket_address(const std::string& path){
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
+      throw std::runtime_error("ConvertService socket path too long: " + path);
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+  }
+
+  int ConvertService::listen(const std::string& path){
+    // a client that hangs up mid reply must surface as a failed write
+    std::signal(SIGPIPE, SIG_IGN);
+    sockaddr_un address = socket_address(path);
+
+    struct stat st;
+    if(::stat(path.c_str(), &st) == 0){
+      if(!S_ISSOCK(st.st_mode))
+        throw std::runtime_error("ConvertService refusing to replace " + path);
+      int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      bool alive = probe >= 0 && ::connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+      if(probe >= 0)
+        ::close(probe);
+      if(alive)
+        throw std::runtime_error("ConvertService already running on " + path);
+      ::unlink(path.c_str());
+    }
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+      throw std::runtime_error("ConvertService failed to create socket");
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if(::bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(fd, 64) != 0){
+      int error = errno;
+      ::close(fd);
+      throw std::runtime_error("ConvertService failed to listen on " + path + ": " + std::strerror(error));
+    }
+    return fd;
+  }
+
+  int ConvertService::connect(const std::string& path){
+    std::signal(SIGPIPE, SIG_IGN);
+    sockaddr_un address = socket_address(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+      throw std::runtime_error("ConvertService failed to create socket");
+    if(::connect(fd, (sockaddr*)&address, sizeof(address)) != 0){
+      int error = errno;
+      ::close(fd);
+      throw std::runtime_error("ConvertService failed to connect to " + path + ": " + std::strerror(error));
+    }
+    return fd;
+  }
+
+  static bool read_limited(int fd, std::string& value){
+    uint32_t length = 0;
+    if(!read_all(fd, &length, sizeof(length)) || length > max_string)
+      return false;
+    value.resize(length);
+    return read_all(fd, &value[0], length);
+  }
+
+  bool ConvertService::send_job(int fd, const ServiceJob& job){
+    uint64_t data_size = job.data.size();
+    uint32_t y_up = job.y_up ? 1 : 0;
+    uint32_t flag_count = (uint32_t)job.flags.size();
+    if(!write_all(fd, job_magic, sizeof(job_magic)) ||
+       !write_all(fd, &version, sizeof(version)) ||
+       !write_string(fd, job.input) ||
+       !write_all(fd, &data_size, sizeof(data_size)) ||
+       !write_all(fd, job.data.data(), job.data.size()) ||
+       !write_all(fd, &job.rotate_z, sizeof(job.rotate_z)) ||
+       !write_all(fd, &y_up, sizeof(y_up)) ||
+       !write_all(fd, &flag_count, sizeof(flag_count)))
+      return false;
+    for(const std::string& flag : job.flags){
+      if(!write_string(fd, flag))
+        return false;
+    }
+    return true;
+  }
+
+  bool ConvertService::receive_job(int fd, ServiceJob& job, uint64_t max_data){
+    char magic[4];
+    uint32_t job_version = 0;
+    uint64_t data_size = 0;
+    uint32_t y_up = 0;
+    uint32_t flag_count = 0;
+    if(!read_all(fd, magic, sizeof(magic)) || std::memcmp(magic, job_magic, sizeof(magic)) != 0 ||
+       !read_all(fd, &job_version, sizeof(job_version)) || job_version != version ||
+       !read_limited(fd, job.input) ||
+       !read_all(fd, &data_size, sizeof(data_size)) || data_size > max_data)
+      return false;
+    job.data.resize((size_t)data_size);
+    if(!read_all(fd, &job.data[0], job.data.size()) ||
+       !read_all(fd, &job.rotate_z, sizeof(job.rotate_z)) ||
+       !read_all(fd, &y_up, sizeof(y_up)) ||
+       !read_all(fd, &flag_count, sizeof(flag_count)) || flag_count > max_string)
+      return false;
+    job.y_up = y_up != 0;
+    job.flags.resize(flag_count);
+    for(std::string& flag : job.flags){
+      if(!read_limited(fd, flag))
+        return false;
+    }
+    return true;
+  }
+
+  bool ConvertService::send_reply(int fd, bool ok, const std::string& message, const std::vector<ServiceFile>& files){
+    // every file must be readable before the status goes out
+    std::vector<uint64_t> sizes;
+    for(const ServiceFile& file : files){
+      struct stat st;
+      if(::stat(file.path.c_str(), &st) != 0){
+        uint32_t status = 0;
+        return write_all(fd, &status, sizeof(status)) && write_string(fd, "missing output " + file.path) && write_string(fd, "");
+      }
+      sizes.push_back((uint64_t)st.st_size);
+    }
+
+    uint32_t status = ok ? 1 : 0;
+    if(!write_all(fd, &status, sizeof(status)) || !write_string(fd, message))
+      return false;
+    std::vector<char> block(stream_block);
+    for(size_t f = 0; f < files.size(); ++f){
+      std::FILE* in = std::fopen(files[f].path.c_str(), "rb");
+      if(!in)
+        return false;
+      bool sent = write_string(fd, files[f].name) && write_all(fd, &sizes[f], sizeof(sizes[f]));
+      for(uint64_t left = sizes[f]; sent && left > 0;){
+        size_t count = (size_t)std::min<uint64_t>(left, block.size());
+        sent = std::fread(block.data(), 1, count, in) == count && write_all(fd, block.data(), count);
+        left -= count;
+      }
+      std::fclose(in);
+      if(!sent)
+        return false;
+    }
+    return write_string(fd, "");
+  }
+
+  bool ConvertService::receive_reply(int fd, const std::string& output_dir, ServiceReply& reply){
+    uint32_t status = 0;
+    if(!read_all(fd, &status, sizeof(status)) || !read_limited(fd, reply.message))
+      return false;
+    reply.ok = status != 0;
+    std::vector<char> block(stream_block);
+    for(;;){
+      std::string name;
+      uint64_t size = 0;
+      if(!read_limited(fd, name))
+        return false;
+      if(name.empty())
+        return true;
+      // never write outside output_dir whatever the daemon sends
+      name = name.substr(name.find_last_of('/') + 1);
+      if(name.empty() || name == "." || name == ".." || !read_all(fd, &size, sizeof(size)))
+        return false;
+      std::string path = output_dir + "/" + name;
+      std::FILE* out = std::fopen(path.c_str(), "wb");
+      if(!out)
+        return false;
+      bool received = true;
+      for(uint64_t left = size; received && left > 0;){
+        size_t count = (size_t)std::min<uint64_t>(left, block.size());
+        received = read_all(fd, block.data(), count) && std::fwrite(block.data(), 1, count, out) == count;
+        left -= count;
+      }
+      received = std::fclose(out) == 0 && received;
+      if(!received)
+        return false;
+      reply.files.push_back(path);
+    }
+  }
+}
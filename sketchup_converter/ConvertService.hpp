@@ -0,0 +1,68 @@
+//
+//  ConvertService.hpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#ifndef ConvertService_hpp
+#define ConvertService_hpp
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace trisetra {
+
+  // conversion request to a --serve daemon, one per connection
+  struct ServiceJob{
+    // path as seen by the daemon, or just the file name when data is inline
+    std::string input;
+    // .skp bytes sent along with the job, empty to read input from the daemon's disk
+    std::string data;
+    float rotate_z = 0.0f;
+    bool  y_up = false;
+    // any other conversion flags exactly as on the command line, e.g. "--lods", "2", "--weld"
+    std::vector<std::string> flags;
+  };
+
+  // file streamed back for a job, path on the sending side and the bare name it is stored under
+  struct ServiceFile{
+    std::string path;
+    std::string name;
+  };
+
+  struct ServiceReply{
+    bool        ok = false;
+    // error when the job failed, a short summary otherwise
+    std::string message;
+    // files as stored by the receiving side
+    std::vector<std::string> files;
+  };
+
+  // protocol over a Unix domain stream socket, all integers native endian since both ends run on one machine:
+  //   job:   'T','R','S','J', uint32 version, string input, uint64 data size + data, float rotate_z,
+  //          uint32 y_up, uint32 flag_count, flag_count * string
+  //   reply: uint32 ok, string message, per file: string name, uint64 size, bytes, then an empty name
+  // strings are uint32 length + bytes
+  class ConvertService{
+  public:
+    static const uint32_t version = 1;
+    // largest inline .skp receive_job accepts unless told otherwise
+    static const uint64_t default_max_data = 1ull << 30;
+
+    // listening socket bound to path, a stale socket file left by a dead daemon is replaced
+    static int listen(const std::string& path);
+    static int connect(const std::string& path);
+
+    static bool send_job(int fd, const ServiceJob& job);
+    // false for a malformed job or inline data larger than max_data, which is never allocated
+    static bool receive_job(int fd, ServiceJob& job, uint64_t max_data = default_max_data);
+    // streams every file from disk in blocks, a file that cannot be read fails the whole reply
+    static bool send_reply(int fd, bool ok, const std::string& message, const std::vector<ServiceFile>& files);
+    // writes the streamed files into output_dir
+    static bool receive_reply(int fd, const std::string& output_dir, ServiceReply& reply);
+  };
+}
+
+#endif /* ConvertService_hpp */
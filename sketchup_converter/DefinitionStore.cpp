@@ -0,0 +1,211 @@
+//
+//  DefinitionStore.cpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#include "DefinitionStore.hpp"
+#include "ConversionCache.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace trisetra {
+
+  const uint32_t DefinitionStore::version;
+
+  static const char definition_magic[4] = {'T','R','S','D'};
+
+  template<typename T>
+  static void append_array(std::vector<char>& dst, const std::vector<T>& src){
+    uint64_t count = src.size();
+    dst.insert(dst.end(), (const char*)&count, (const char*)&count + sizeof(count));
+    dst.insert(dst.end(), (const char*)src.data(), (const char*)(src.data() + src.size()));
+  }
+
+  static void append_string(std::vector<char>& dst, const std::string& src){
+    uint64_t count = src.size();
+    dst.insert(dst.end(), (const char*)&count, (const char*)&count + sizeof(count));
+    dst.insert(dst.end(), src.begin(), src.end());
+  }
+
+  // bounds checked reads, every failure means a damaged file
+  struct DefinitionReader{
+    const std::vector<char>& data;
+    size_t                   end;
+    size_t                   offset;
+
+    bool take(void* dst, size_t size){
+      if(size > end - offset)
+        return false;
+      if(size)
+        std::memcpy(dst, data.data() + offset, size);
+      offset += size;
+      return true;
+    }
+    bool count(uint64_t& n, size_t element_size){
+      return take(&n, sizeof(n)) && n <= (end - offset)/element_size;
+    }
+    template<typename T>
+    bool array(std::vector<T>& dst){
+      uint64_t n = 0;
+      if(!count(n, sizeof(T)))
+        return false;
+      dst.resize((size_t)n);
+      return take(dst.data(), (size_t)n*sizeof(T));
+    }
+    bool string(std::string& dst){
+      uint64_t n = 0;
+      if(!count(n, 1))
+        return false;
+      dst.assign(data.data() + offset, (size_t)n);
+      offset += (size_t)n;
+      return true;
+    }
+  };
+
+  struct StoredFile{
+    std::string path;
+    time_t      used;
+    uint64_t    bytes;
+  };
+
+  // every complete definition file below root, returns their total size
+  static uint64_t scan_files(const std::string& root, std::vector<StoredFile>& files){
+    uint64_t total = 0;
+    DIR* handle = ::opendir(root.c_str());
+    if(!handle)
+      return 0;
+    while(dirent* item = ::readdir(handle)){
+      std::string name = item->d_name;
+      if(name.size() != 20 || name.compare(16, 4, ".def") != 0 ||
+         name.find_first_not_of("0123456789abcdef") != 16)
+        continue;
+      StoredFile file{root + "/" + name, 0, 0};
+      struct stat st;
+      if(::stat(file.path.c_str(), &st) != 0)
+        continue;
+      file.used = st.st_mtime;
+      file.bytes = (uint64_t)st.st_size;
+      total += file.bytes;
+      files.push_back(file);
+    }
+    ::closedir(handle);
+    return total;
+  }
+
+  DefinitionStore::DefinitionStore(const std::string& root, uint64_t max_bytes) : _root(root), _max_bytes(max_bytes){
+    if(::mkdir(root.c_str(), 0755) != 0 && errno != EEXIST)
+      throw std::runtime_error("DefinitionStore failed to create " + root);
+  }
+
+  std::string DefinitionStore::path(uint64_t key) const{
+    char name[24];
+    std::snprintf(name, sizeof(name), "%016llx.def", (unsigned long long)key);
+    return _root + "/" + name;
+  }
+
+  bool DefinitionStore::load(uint64_t key, StoredDefinition& definition) const{
+    std::string file_path = path(key);
+    std::FILE* file = std::fopen(file_path.c_str(), "rb");
+    if(!file)
+      return false;
+    std::vector<char> data;
+    char block[1 << 16];
+    for(size_t n; (n = std::fread(block, 1, sizeof(block), file)) > 0;)
+      data.insert(data.end(), block, block + n);
+    std::fclose(file);
+
+    uint64_t stored_hash = 0;
+    if(data.size() < sizeof(definition_magic) + sizeof(uint32_t) + sizeof(stored_hash))
+      return false;
+    size_t end = data.size() - sizeof(stored_hash);
+    std::memcpy(&stored_hash, data.data() + end, sizeof(stored_hash));
+    if(stored_hash != hash64(data.data(), end))
+      return false;
+
+    DefinitionReader reader{data, end, 0};
+    char magic[4];
+    uint32_t file_version = 0;
+    uint64_t material_count = 0;
+    if(!reader.take(magic, sizeof(magic)) || std::memcmp(magic, definition_magic, sizeof(magic)) != 0 ||
+       !reader.take(&file_version, sizeof(file_version)) || file_version != version ||
+       !reader.array(definition.pos) || !reader.array(definition.normal) || !reader.array(definition.uv) ||
+       !reader.array(definition.index) || !reader.count(material_count, sizeof(uint64_t)))
+      return false;
+    definition.materials.resize((size_t)material_count);
+    for(std::string& material : definition.materials){
+      if(!reader.string(material))
+        return false;
+    }
+    if(!reader.array(definition.face_material_idx) || reader.offset != end)
+      return false;
+    ::utimes(file_path.c_str(), nullptr);
+    return true;
+  }
+
+  void DefinitionStore::save(uint64_t key, const StoredDefinition& definition){
+    std::vector<char> data(definition_magic, definition_magic + sizeof(definition_magic));
+    data.insert(data.end(), (const char*)&version, (const char*)&version + sizeof(version));
+    append_array(data, definition.pos);
+    append_array(data, definition.normal);
+    append_array(data, definition.uv);
+    append_array(data, definition.index);
+    uint64_t material_count = definition.materials.size();
+    data.insert(data.end(), (const char*)&material_count, (const char*)&material_count + sizeof(material_count));
+    for(const std::string& material : definition.materials)
+      append_string(data, material);
+    append_array(data, definition.face_material_idx);
+    uint64_t hash = hash64(data.data(), data.size());
+    data.insert(data.end(), (const char*)&hash, (const char*)&hash + sizeof(hash));
+
+    static std::atomic<uint32_t> counter(0);
+    std::string final_path = path(key);
+    std::string temp = final_path + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(counter++);
+    std::FILE* file = std::fopen(temp.c_str(), "wb");
+    if(!file)
+      throw std::runtime_error("DefinitionStore failed to create " + temp);
+    bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = std::fclose(file) == 0 && written;
+    if(!written || ::rename(temp.c_str(), final_path.c_str()) != 0){
+      ::unlink(temp.c_str());
+      throw std::runtime_error("DefinitionStore failed to write " + final_path);
+    }
+    evict(data.size());
+  }
+
+  void DefinitionStore::evict(uint64_t added_bytes){
+    std::lock_guard<std::mutex> lock(_evict_mutex);
+    if(_total_known){
+      _total_bytes += added_bytes;
+      if(_total_bytes <= _max_bytes)
+        return;
+    }
+    // the first save and every overflow rescan, which also picks up what other processes saved
+    std::vector<StoredFile> files;
+    uint64_t total = scan_files(_root, files);
+    _total_known = true;
+    if(total <= _max_bytes){
+      _total_bytes = total;
+      return;
+    }
+
+    uint64_t low_water = _max_bytes - _max_bytes/10;
+    std::sort(files.begin(), files.end(), [](const StoredFile& a, const StoredFile& b){ return a.used < b.used; });
+    for(const StoredFile& file : files){
+      if(total <= low_water)
+        break;
+      if(::unlink(file.path.c_str()) == 0 || errno == ENOENT)
+        total -= file.bytes;
+    }
+    _total_bytes = total;
+  }
+}
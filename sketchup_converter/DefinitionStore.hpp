@@ -0,0 +1,70 @@
+//
+//  DefinitionStore.hpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#ifndef DefinitionStore_hpp
+#define DefinitionStore_hpp
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace trisetra {
+
+  // local geometry of one component definition as load_skp extracts it, the mesh palette by material name
+  struct StoredDefinition{
+    std::vector<float>       pos;
+    std::vector<float>       normal;
+    std::vector<float>       uv;
+    std::vector<uint32_t>    index;
+    std::vector<std::string> materials;
+    std::vector<int32_t>     face_material_idx;
+  };
+
+  // definition geometry persisted between runs, keyed by a content hash of the definition's faces,
+  // materials and UVs so an edited model only re-extracts what changed. one file per key:
+  //   <root>/<key as 16 hex digits>.def  'T','R','S','D', uint32 version, pos, normal, uv, index,
+  //                                      materials, face_material_idx, uint64 hash64 of all preceding bytes
+  // arrays are a uint64 element count followed by the elements, strings the same with bytes.
+  // a load refreshes the file time, once root exceeds max_bytes the least recently used files go
+  // until it is back under 90% of it. like ConversionCache the size of root is tracked in memory
+  // after one scan, only exceeding max_bytes scans it again
+  class DefinitionStore{
+  public:
+    static const uint32_t version = 1;
+
+    DefinitionStore(const std::string& root, uint64_t max_bytes);
+
+    const std::string& root() const { return _root; }
+    uint64_t max_bytes() const { return _max_bytes; }
+    // false if the key is unknown or its file is damaged
+    bool load(uint64_t key, StoredDefinition& definition) const;
+    // written under a temporary name and renamed, concurrent loads see the old file or the new one.
+    // evicts if root exceeds max_bytes afterwards
+    void save(uint64_t key, const StoredDefinition& definition);
+
+  protected:
+    std::string path(uint64_t key) const;
+    // accounts for a saved file of added_bytes and evicts down to 90% once the total exceeds max_bytes
+    void evict(uint64_t added_bytes);
+
+    std::string _root;
+    uint64_t    _max_bytes;
+    std::mutex  _evict_mutex;
+    // size of all files, kept up to date from the first save on without rescanning root
+    uint64_t    _total_bytes = 0;
+    bool        _total_known = false;
+  };
+
+  // what the definition store did during one load
+  struct DefinitionCounts{
+    size_t reused = 0;
+    size_t extracted = 0;
+  };
+}
+
+#endif /* DefinitionStore_hpp */
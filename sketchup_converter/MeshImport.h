@@ -18,7 +18,23 @@ struct MaterialData{
   std::string name;
   std::string base_color_map;
   float base_color[4];
-  float opacity;
+  float opacity = 1.0f;
+};
+
+// consecutive triangles sharing a material, drawn with one call
+struct DrawRange{
+  uint32_t first_index;
+  uint32_t index_count;
+  uint32_t material;
+};
+
+// coarser triangle list over the vertices of its MeshSource
+struct MeshLod{
+  std::vector<uint32_t> index;
+  std::vector<int32_t> face_material_idx;
+  // geometric deviation from the full mesh in mesh units, a runtime turns it into pixels with
+  // error/distance * viewport_height/(2*tan(fov_y/2)) and picks the coarsest level below its threshold
+  float error = 0.0f;
 };
 
 class MeshSource{
@@ -31,8 +47,11 @@ public:
   std::vector<float>  normal;
   std::vector<float>  uv;
   std::vector<uint32_t> index;
+  // palette of distinct materials used by this mesh, face_material_idx (one per triangle) indexes into it
   std::vector<const MaterialData* > materials;
   std::vector<int32_t> face_material_idx;
+  // levels of detail, coarsest last
+  std::vector<MeshLod> lods;
 };
 
 class Node{
@@ -62,7 +81,7 @@ public:
   
   // indicate number of vertcies per face
   virtual void add_face_descriptor(MeshSource* mesh,std::vector<uint8_t>&& vert_per_face) = 0;
-  // material_idx is used to access add_materials std::vector<std::shared_ptr<MaterialData>> material_data
+  // material_idx is used to access the mesh palette built by apply_material
   virtual void add_face_material_idx(MeshSource* mesh,std::vector<int32_t>&& material_idx) = 0;
   
   
@@ -77,9 +96,12 @@ public:
   
   virtual void add_materials(const std::vector< std::shared_ptr<MaterialData> >& material_data) = 0;
   virtual const std::shared_ptr<MaterialData> get_material( int idx ) = 0;
+  // adds material to the mesh palette if not present, returns its palette index
   virtual int  apply_material(MeshSource* mesh, const MaterialData* material) = 0;
   virtual void add_mdl_path(const std::string& mdl_path) = 0;
   virtual void add_texture_path(std::unordered_set<std::string>&&) = 0;
+  // drops meshes no node links to, e.g. local geometry only ever used through baked variants
+  virtual void remove_unreferenced_meshes() = 0;
 };
 
 }
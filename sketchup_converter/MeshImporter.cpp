@@ -7,11 +7,15 @@
 //
 #include <Eigen/Dense>
 #include "MeshImporter.hpp"
+#include "AssetIO.hpp"
+#include "Parallel.hpp"
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 
 #define fmax std::numeric_limits<float>::max()
-#define fmin std::numeric_limits<float>::min()
   ////////////// Mesh Operations //////////////
   void MeshImporter::add_positions(MeshSource* mesh, std::vector<float>&& src, std::vector<uint32_t>&& idx_buffer){
     mesh->pos = std::move(src);
@@ -45,7 +49,7 @@
   void MeshImporter::add_face_descriptor(MeshSource* mesh,std::vector<uint8_t>&& vert_per_face){
     
   }
-  // material_idx is used to access add_materials std::vector<std::shared_ptr<MaterialData>> material_data
+  // material_idx is used to access the mesh palette built by apply_material
   void MeshImporter::add_face_material_idx(MeshSource* mesh,std::vector<int32_t>&& material_idx){
     mesh->face_material_idx = std::move(material_idx);
   }
@@ -90,6 +94,11 @@
   }
 
   int  MeshImporter::apply_material(MeshSource* mesh, const MaterialData* material){
+    // palette is one entry per distinct material, typically a handful per mesh
+    auto it = std::find(mesh->materials.begin(), mesh->materials.end(), material);
+    if(it != mesh->materials.end()){
+      return (int)(it - mesh->materials.begin());
+    }
     mesh->materials.push_back(material);
     return (int)(mesh->materials.size()-1);
   }
@@ -102,159 +111,1032 @@
     _textures = std::move(texts);
   }
 
-  void MeshImporter::serialize_to_file(const std::string& file_path, bool flattern, bool y_up, float rotatate_z){
+  void MeshImporter::remove_unreferenced_meshes(){
+    std::unordered_set<const MeshSource*> referenced;
+    for(const auto& node : _nodes){
+      if(node->mesh)
+        referenced.insert(node->mesh);
+    }
+    _mesh_sources.erase(std::remove_if(_mesh_sources.begin(), _mesh_sources.end(),
+                                       [&](const std::shared_ptr<MeshSource>& mesh){ return !referenced.count(mesh.get()); }),
+                        _mesh_sources.end());
+  }
+
+  void MeshImporter::weld_vertices(const WeldOptions& options){
+    size_t before = 0;
+    size_t removed = 0;
+    for(auto& mesh : _mesh_sources){
+      before += mesh->pos.size()/3;
+      removed += trisetra::weld_vertices(mesh.get(), options);
+    }
+    std::cout<< "welded vertices:" << before << " -> " << before - removed <<std::endl;
+  }
+
+  void MeshImporter::optimize_meshes(unsigned cache_size){
+    std::vector<VertexCacheStats> before(_mesh_sources.size());
+    std::vector<VertexCacheStats> after(_mesh_sources.size());
+    parallel_for(_mesh_sources.size(), [&](size_t m){
+      MeshSource* mesh = _mesh_sources[m].get();
+      before[m] = measure_vertex_cache(mesh->index, mesh->pos.size()/3, cache_size);
+      optimize_vertex_cache(mesh, cache_size);
+      optimize_vertex_fetch(mesh);
+      after[m] = measure_vertex_cache(mesh->index, mesh->pos.size()/3, cache_size);
+    });
+    
+    VertexCacheStats total_before;
+    VertexCacheStats total_after;
+    for(size_t m = 0; m < _mesh_sources.size(); ++m){
+      total_before.triangles += before[m].triangles;
+      total_before.vertices += before[m].vertices;
+      total_before.misses += before[m].misses;
+      total_after.triangles += after[m].triangles;
+      total_after.vertices += after[m].vertices;
+      total_after.misses += after[m].misses;
+    }
+    std::cout<< "vertex cache(" << cache_size << ") acmr:" << total_before.acmr() << " -> " << total_after.acmr()
+             << " atvr:" << total_before.atvr() << " -> " << total_after.atvr() <<std::endl;
+  }
+
+  void MeshImporter::generate_lods(const LodOptions& options){
+    std::vector<size_t> levels(_mesh_sources.size());
+    parallel_for(_mesh_sources.size(), [&](size_t m){
+      levels[m] = trisetra::generate_lods(_mesh_sources[m].get(), options);
+    });
+    
+    // triangles summed per level, meshes with a shorter chain count their coarsest level
+    size_t longest = levels.empty() ? 0 : *std::max_element(levels.begin(), levels.end());
+    std::vector<size_t> triangles(longest + 1, 0);
+    size_t meshes_with_lods = 0;
+    for(size_t m = 0; m < _mesh_sources.size(); ++m){
+      const MeshSource* mesh = _mesh_sources[m].get();
+      meshes_with_lods += levels[m] > 0 ? 1 : 0;
+      triangles[0] += mesh->index.size()/3;
+      for(size_t l = 1; l <= longest; ++l)
+        triangles[l] += (l <= levels[m] ? mesh->lods[l-1].index.size() : (levels[m] ? mesh->lods.back().index.size() : mesh->index.size()))/3;
+    }
+    std::cout<< "lods: " << meshes_with_lods << "/" << _mesh_sources.size() << " meshes, triangles";
+    for(size_t count : triangles)
+      std::cout<< " " << count;
+    std::cout<<std::endl;
+  }
+
+  const uint32_t MeshImporter::no_material;
+  
+  size_t MeshImporter::triangle_count() const{
+    size_t count = 0;
+    for(const auto& node : _nodes){
+      if(node->mesh)
+        count += node->mesh->index.size()/3;
+    }
+    return count;
+  }
+  
+  std::vector<std::string> MeshImporter::texture_maps() const{
+    std::vector<std::string> maps;
+    for(const auto& material : _materials){
+      if(!material->base_color_map.empty() &&
+         std::find(maps.begin(), maps.end(), material->base_color_map) == maps.end())
+        maps.push_back(material->base_color_map);
+    }
+    for(const std::string& texture : _textures){
+      if(std::find(maps.begin(), maps.end(), texture) == maps.end())
+        maps.push_back(texture);
+    }
+    return maps;
+  }
+  
+  void MeshImporter::sort_by_material(){
+    parallel_for(_mesh_sources.size(), [&](size_t m){
+      trisetra::sort_by_material(_mesh_sources[m].get());
+    });
+  }
+  
+  MeshImporter::MaterialIds MeshImporter::material_ids() const{
+    MaterialIds ids;
+    ids.reserve(_materials.size());
+    for(size_t i = 0; i < _materials.size(); ++i)
+      ids.emplace(_materials[i].get(), (uint32_t)i);
+    return ids;
+  }
+  
+  // pack_scene layout, native endian since both ends are the same binary:
+  //   uint64 material_count, per material: float4 base_color, float opacity, name, base_color_map
+  //   uint64 texture_count, per texture: path
+  //   uint64 mesh_count, per mesh: name, pos, normal, uv, index, palette (int64 material, -1 for none),
+  //                                face_material_idx, uint64 lod_count, per lod: float error, index, face_material_idx
+  //   uint64 node_count, per node: int64 parent, int64 mesh (-1 for none), float[16] matrix
+  // strings and arrays are a uint64 element count followed by the elements
+  struct ScenePacker{
+    char*  dst;
+    size_t size = 0;
+    
+    void put(const void* src, size_t bytes){
+      if(dst && bytes)
+        std::memcpy(dst + size, src, bytes);
+      size += bytes;
+    }
+    template<typename T>
+    void value(const T& v){ put(&v, sizeof(T)); }
+    template<typename T>
+    void array(const std::vector<T>& v){
+      value<uint64_t>(v.size());
+      put(v.data(), v.size()*sizeof(T));
+    }
+    void string(const std::string& v){
+      value<uint64_t>(v.size());
+      put(v.data(), v.size());
+    }
+  };
+  
+  struct SceneUnpacker{
+    const char* src;
+    size_t      size;
+    size_t      offset = 0;
+    
+    const char* take(size_t bytes){
+      if(bytes > size - offset)
+        throw std::runtime_error("packed scene truncated");
+      const char* p = src + offset;
+      offset += bytes;
+      return p;
+    }
+    template<typename T>
+    T value(){
+      T v;
+      std::memcpy(&v, take(sizeof(T)), sizeof(T));
+      return v;
+    }
+    size_t count(size_t element_size){
+      uint64_t n = value<uint64_t>();
+      if(n > (size - offset)/std::max<size_t>(element_size, 1))
+        throw std::runtime_error("packed scene truncated");
+      return (size_t)n;
+    }
+    template<typename T>
+    std::vector<T> array(){
+      size_t n = count(sizeof(T));
+      std::vector<T> v(n);
+      const char* p = take(n*sizeof(T));
+      if(n)
+        std::memcpy(v.data(), p, n*sizeof(T));
+      return v;
+    }
+    std::string string(){
+      size_t n = count(1);
+      return std::string(take(n), n);
+    }
+  };
+  
+  size_t MeshImporter::pack_scene(char* dst) const{
+    ScenePacker packer{dst};
+    MaterialIds ids = material_ids();
+    
+    packer.value<uint64_t>(_materials.size());
+    for(const auto& material : _materials){
+      packer.put(material->base_color, sizeof(material->base_color));
+      packer.value(material->opacity);
+      packer.string(material->name);
+      packer.string(material->base_color_map);
+    }
+    std::vector<std::string> textures = texture_maps();
+    packer.value<uint64_t>(textures.size());
+    for(const std::string& texture : textures)
+      packer.string(texture);
+    
+    std::unordered_map<const MeshSource*, int64_t> mesh_ids;
+    packer.value<uint64_t>(_mesh_sources.size());
+    for(size_t m = 0; m < _mesh_sources.size(); ++m){
+      const MeshSource* mesh = _mesh_sources[m].get();
+      mesh_ids.emplace(mesh, (int64_t)m);
+      packer.string(mesh->name);
+      packer.array(mesh->pos);
+      packer.array(mesh->normal);
+      packer.array(mesh->uv);
+      packer.array(mesh->index);
+      packer.value<uint64_t>(mesh->materials.size());
+      for(const MaterialData* material : mesh->materials){
+        auto it = ids.find(material);
+        if(material && it == ids.end())
+          throw std::runtime_error("pack_scene: mesh " + mesh->name + " uses a material outside the material table");
+        packer.value<int64_t>(material ? (int64_t)it->second : -1);
+      }
+      packer.array(mesh->face_material_idx);
+      packer.value<uint64_t>(mesh->lods.size());
+      for(const MeshLod& lod : mesh->lods){
+        packer.value(lod.error);
+        packer.array(lod.index);
+        packer.array(lod.face_material_idx);
+      }
+    }
+    
+    std::unordered_map<const Node*, int64_t> node_ids;
+    for(size_t n = 0; n < _nodes.size(); ++n)
+      node_ids.emplace(_nodes[n].get(), (int64_t)n);
+    packer.value<uint64_t>(_nodes.size());
+    for(const auto& node : _nodes){
+      auto parent = node_ids.find(node->parent);
+      auto mesh = mesh_ids.find(node->mesh);
+      packer.value<int64_t>(parent != node_ids.end() ? parent->second : -1);
+      packer.value<int64_t>(mesh != mesh_ids.end() ? mesh->second : -1);
+      packer.put(node->matrix.data(), 16*sizeof(float));
+    }
+    return packer.size;
+  }
+  
+  void MeshImporter::unpack_scene(const char* src, size_t size){
+    SceneUnpacker unpacker{src, size};
+    _materials.clear();
+    _textures.clear();
+    _mesh_sources.clear();
+    _nodes.clear();
+    
+    size_t material_count = unpacker.count(sizeof(MaterialData::base_color) + sizeof(float));
+    for(size_t i = 0; i < material_count; ++i){
+      auto material = std::make_shared<MaterialData>();
+      std::memcpy(material->base_color, unpacker.take(sizeof(material->base_color)), sizeof(material->base_color));
+      material->opacity = unpacker.value<float>();
+      material->name = unpacker.string();
+      material->base_color_map = unpacker.string();
+      _materials.push_back(material);
+    }
+    size_t texture_count = unpacker.count(sizeof(uint64_t));
+    for(size_t i = 0; i < texture_count; ++i)
+      _textures.insert(unpacker.string());
+    
+    size_t mesh_count = unpacker.count(sizeof(uint64_t));
+    for(size_t m = 0; m < mesh_count; ++m){
+      auto mesh = create_mesh(unpacker.string());
+      mesh->pos = unpacker.array<float>();
+      mesh->normal = unpacker.array<float>();
+      mesh->uv = unpacker.array<float>();
+      mesh->index = unpacker.array<uint32_t>();
+      size_t palette_count = unpacker.count(sizeof(int64_t));
+      for(size_t i = 0; i < palette_count; ++i){
+        int64_t material = unpacker.value<int64_t>();
+        if(material >= (int64_t)_materials.size())
+          throw std::runtime_error("packed scene material out of range");
+        mesh->materials.push_back(material < 0 ? nullptr : _materials[(size_t)material].get());
+      }
+      mesh->face_material_idx = unpacker.array<int32_t>();
+      size_t lod_count = unpacker.count(sizeof(float));
+      mesh->lods.resize(lod_count);
+      for(MeshLod& lod : mesh->lods){
+        lod.error = unpacker.value<float>();
+        lod.index = unpacker.array<uint32_t>();
+        lod.face_material_idx = unpacker.array<int32_t>();
+      }
+    }
+    
+    size_t node_count = unpacker.count(2*sizeof(int64_t) + 16*sizeof(float));
+    std::vector<int64_t> parents(node_count);
+    for(size_t n = 0; n < node_count; ++n){
+      auto node = create_node(nullptr, "");
+      parents[n] = unpacker.value<int64_t>();
+      int64_t mesh = unpacker.value<int64_t>();
+      if(mesh >= (int64_t)_mesh_sources.size())
+        throw std::runtime_error("packed scene mesh out of range");
+      node->mesh = mesh < 0 ? nullptr : _mesh_sources[(size_t)mesh].get();
+      std::memcpy(node->matrix.data(), unpacker.take(16*sizeof(float)), 16*sizeof(float));
+    }
+    // parents may be listed after their children
+    for(size_t n = 0; n < node_count; ++n){
+      if(parents[n] >= (int64_t)node_count)
+        throw std::runtime_error("packed scene parent out of range");
+      _nodes[n]->parent = parents[n] < 0 ? nullptr : _nodes[(size_t)parents[n]].get();
+    }
+  }
+  
+  // material table id of every triangle, from the mesh palette
+  static std::vector<uint32_t> triangle_materials(const MeshSource* mesh,
+                                                  const std::vector<int32_t>& face_material,
+                                                  size_t triangle_count,
+                                                  const MeshImporter::MaterialIds& ids){
+    std::vector<uint32_t> palette(mesh->materials.size(), MeshImporter::no_material);
+    for(size_t i = 0; i < mesh->materials.size(); ++i){
+      auto it = ids.find(mesh->materials[i]);
+      if(it != ids.end())
+        palette[i] = it->second;
+    }
+    std::vector<uint32_t> keys(triangle_count, MeshImporter::no_material);
+    if(face_material.size() == triangle_count){
+      for(size_t t = 0; t < triangle_count; ++t){
+        int32_t material = face_material[t];
+        if(material >= 0 && (size_t)material < palette.size())
+          keys[t] = palette[material];
+      }
+    }
+    return keys;
+  }
+  
+  static void write_ranges(BlockWriter& trifile, const std::vector<DrawRange>& ranges){
+    trifile.write_value((uint32_t)ranges.size());
+    trifile.write(ranges.data(), ranges.size()*sizeof(DrawRange));
+  }
+  
+  static void write_string(BlockWriter& trifile, const std::string& value){
+    trifile.write_value((uint32_t)value.size());
+    trifile.write(value.data(), value.size());
+    const char zero[4] = {};
+    trifile.write(zero, (4 - value.size() % 4) % 4);
+  }
+  
+  void MeshImporter::write_material_table(BlockWriter& trifile) const{
+    for(const auto& material : _materials){
+      trifile.write(material->base_color, sizeof(material->base_color));
+      trifile.write_value(material->opacity);
+      write_string(trifile, material->name);
+      write_string(trifile, material->base_color_map);
+    }
+  }
+
+  static void write_ply(const std::string& plyname,
+                        const std::vector<Eigen::Vector3f>& pos,
+                        const std::vector<Eigen::Vector3f>& normal,
+                        const std::vector<float>& uv,
+                        const std::vector<uint32_t>& indecies,
+                        const Eigen::Vector3f& mid_point,
+                        float scale,
+                        const SerializeOptions& options){
+    bool with_uv = options.ply_uv && uv.size() >= pos.size()*2;
+    
+    std::ostringstream header;
+    header<<"ply\n";
+    // the binary blocks are written in host order, all targets we build for are little endian
+    header<<(options.ply_ascii ? "format ascii 1.0\n" : "format binary_little_endian 1.0\n");
+    header<<"element vertex "<< pos.size() <<"\n";
+    header<<"property float x\n";
+    header<<"property float y\n";
+    header<<"property float z\n";
+    if(options.ply_normals){
+      header<<"property float nx\n";
+      header<<"property float ny\n";
+      header<<"property float nz\n";
+    }
+    if(with_uv){
+      header<<"property float s\n";
+      header<<"property float t\n";
+    }
+    header<<"element face " << indecies.size()/3 <<"\n";
+    header<<"property list uchar int vertex_indices\n";
+    header<<"end_header\n";
+    
+    if(options.ply_ascii){
+      std::ofstream outfile;
+      outfile.open (plyname, std::ios::out | std::ios::trunc );
+      outfile<<header.str();
+      for(size_t i = 0; i < pos.size(); ++i){
+        Eigen::Vector3f a_pos = (pos[i] - mid_point)*scale;
+        outfile<< a_pos.x() <<" "<< a_pos.y()<< " " << a_pos.z();
+        if(options.ply_normals)
+          outfile<<" "<< normal[i].x() <<" "<< normal[i].y()<< " " << normal[i].z();
+        if(with_uv)
+          outfile<<" "<< uv[i*2] <<" "<< uv[i*2+1];
+        outfile<<"\n";
+      }
+      for(size_t i = 0; i < indecies.size()/3; ++i){
+        outfile<< "3" <<" "<<indecies[i*3] <<" "<< indecies[i*3+1] << " " << indecies[i*3+2] << "\n";
+      }
+      outfile.close();
+      return;
+    }
+    
+    BlockWriter plyfile(plyname);
+    std::string header_str = header.str();
+    plyfile.write(header_str.data(), header_str.size());
+    
+    size_t vertex_size = (3 + (options.ply_normals ? 3 : 0) + (with_uv ? 2 : 0))*sizeof(float);
+    for(size_t i = 0; i < pos.size(); ++i){
+      char* vertex = plyfile.reserve(vertex_size);
+      Eigen::Vector3f a_pos = (pos[i] - mid_point)*scale;
+      std::memcpy(vertex, a_pos.data(), sizeof(Eigen::Vector3f));
+      vertex += sizeof(Eigen::Vector3f);
+      if(options.ply_normals){
+        std::memcpy(vertex, normal[i].data(), sizeof(Eigen::Vector3f));
+        vertex += sizeof(Eigen::Vector3f);
+      }
+      if(with_uv)
+        std::memcpy(vertex, &uv[i*2], 2*sizeof(float));
+    }
+    
+    for(size_t i = 0; i < indecies.size()/3; ++i){
+      char* face = plyfile.reserve(1 + 3*sizeof(int32_t));
+      face[0] = 3;
+      std::memcpy(face + 1, &indecies[i*3], 3*sizeof(int32_t));
+    }
+    plyfile.close();
+  }
+
+  // legacy flat .tri: 'T','R','I','S', uint32 float count, interleaved vertices, uint32 index count, uint32 indices
+  static void write_tri(const std::string& file_path,
+                        const std::vector<Eigen::Vector3f>& pos,
+                        const std::vector<Eigen::Vector3f>& normal,
+                        const std::vector<float>& uv,
+                        const std::vector<uint32_t>& indecies,
+                        const Eigen::Vector3f& mid_point,
+                        float scale){
+    // vertices are interleaved straight into the writer blocks, disk I/O runs on the writer thread
+    BlockWriter trifile(file_path);
+    trifile.write("TRIS", 4);
+    uint32_t uint_val = (uint32_t)(pos.size()*8);
+    trifile.write_value(uint_val);
+    
+    for(size_t i = 0; i < pos.size(); ++i){
+      char* vertex = trifile.reserve(8*sizeof(float));
+      Eigen::Vector3f a_pos = (pos[i] - mid_point)*scale;
+      std::memcpy(vertex, a_pos.data(), sizeof(Eigen::Vector3f));
+      std::memcpy(vertex + sizeof(Eigen::Vector3f), normal[i].data(), sizeof(Eigen::Vector3f));
+      std::memcpy(vertex + 2*sizeof(Eigen::Vector3f), &uv[i*2], 2*sizeof(float));
+    }
+    
+    uint_val = (uint32_t)indecies.size();
+    trifile.write_value(uint_val);
+    trifile.write(indecies.data(), indecies.size()*sizeof(uint32_t));
+    trifile.close();
+  }
+  
+  // 16 bit indices whenever the mesh allows it
+  static uint32_t index_width(size_t vertex_count){
+    return vertex_count > (1 << 16) ? sizeof(uint32_t) : sizeof(uint16_t);
+  }
+  
+  // indices at index_width, padded to 4 bytes
+  static void write_indices(BlockWriter& trifile, const uint32_t* indices, size_t index_count, uint32_t width){
+    if(width == sizeof(uint32_t)){
+      trifile.write(indices, index_count*sizeof(uint32_t));
+      return;
+    }
+    
+    const size_t batch = 4096;
+    for(size_t i = 0; i < index_count; i += batch){
+      size_t n = std::min(batch, index_count - i);
+      uint16_t* dst = (uint16_t*)trifile.reserve(n*sizeof(uint16_t));
+      for(size_t k = 0; k < n; ++k)
+        dst[k] = (uint16_t)indices[i + k];
+    }
+    if(index_count & 1)
+      trifile.write_value((uint16_t)0);
+  }
+
+  // decode parameters of one mesh, pos = offset + q/65535*extent
+  struct VertexEncoding{
+    VertexFormat format;
+    Eigen::Vector3f offset;
+    Eigen::Vector3f extent;
+  };
+  
+  static VertexEncoding make_encoding(VertexFormat format, const Eigen::Vector3f& min, const Eigen::Vector3f& max){
+    return {format, min, (max - min).cwiseMax(Eigen::Vector3f::Constant(std::numeric_limits<float>::min()))};
+  }
+  
+  static void write_encoding(BlockWriter& trifile, const VertexEncoding& encoding){
+    if(encoding.format == VertexFormat::Float32)
+      return;
+    trifile.write(encoding.offset.data(), sizeof(Eigen::Vector3f));
+    trifile.write(encoding.extent.data(), sizeof(Eigen::Vector3f));
+  }
+  
+  // normal and uv may be null for meshes without them
+  static void encode_vertex(char* vertex, const VertexEncoding& encoding, const Eigen::Vector3f& pos, const float* normal, const float* uv){
+    const float zero[3] = {0.0f, 0.0f, 0.0f};
+    normal = normal ? normal : zero;
+    uv = uv ? uv : zero;
+    if(encoding.format == VertexFormat::Float32){
+      std::memcpy(vertex, pos.data(), 3*sizeof(float));
+      std::memcpy(vertex + 3*sizeof(float), normal, 3*sizeof(float));
+      std::memcpy(vertex + 6*sizeof(float), uv, 2*sizeof(float));
+      return;
+    }
+    
+    uint16_t* q = (uint16_t*)vertex;
+    Eigen::Vector3f unorm = (pos - encoding.offset).cwiseQuotient(encoding.extent);
+    for(int i = 0; i < 3; ++i)
+      q[i] = (uint16_t)std::lround(std::min(std::max(unorm[i], 0.0f), 1.0f)*65535.0f);
+    
+    uint32_t oct[2];
+    if(encoding.format == VertexFormat::Quantized12){
+      encode_octahedral(normal, 8, oct);
+      vertex[6] = (char)oct[0];
+      vertex[7] = (char)oct[1];
+      q[4] = float_to_half(uv[0]);
+      q[5] = float_to_half(uv[1]);
+    } else {
+      q[3] = 0;
+      encode_octahedral(normal, 16, oct);
+      q[4] = (uint16_t)oct[0];
+      q[5] = (uint16_t)oct[1];
+      q[6] = float_to_half(uv[0]);
+      q[7] = float_to_half(uv[1]);
+    }
+  }
+  
+  // flattened output as a .tri v2 under identity root nodes, either one mesh or, with split16,
+  // one mesh of at most 64K vertices per chunk. triangle_keys holds the material of every triangle
+  void MeshImporter::write_flat_v2(const std::string& file_path,
+                            const std::vector<Eigen::Vector3f>& pos,
+                            const std::vector<Eigen::Vector3f>& normal,
+                            const std::vector<float>& uv,
+                            const std::vector<uint32_t>& indecies,
+                            const Eigen::Vector3f& mid_point,
+                            float scale,
+                            const std::vector<uint32_t>& triangle_keys,
+                            bool split16,
+                            VertexFormat format) const{
+    std::vector<IndexChunk> chunks;
+    if(split16)
+      chunks = split_index16(indecies, pos.size());
+    size_t mesh_count = split16 ? chunks.size() : 1;
+    
+    BlockWriter trifile(file_path);
+    trifile.write("TRI2", 4);
+    trifile.write_value((uint32_t)mesh_count);
+    trifile.write_value((uint32_t)mesh_count);
+    trifile.write_value((uint32_t)format);
+    trifile.write_value((uint32_t)_materials.size());
+    
+    size_t stride = vertex_stride(format);
+    // vertices of a chunk, or all of them if vertices is null
+    auto write_vertices = [&](size_t count, const uint32_t* vertices){
+      Eigen::Vector3f min = Eigen::Vector3f::Constant(fmax);
+      Eigen::Vector3f max = Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+      if(format != VertexFormat::Float32){
+        for(size_t i = 0; i < count; ++i){
+          Eigen::Vector3f a_pos = (pos[vertices ? vertices[i] : i] - mid_point)*scale;
+          min = min.cwiseMin(a_pos);
+          max = max.cwiseMax(a_pos);
+        }
+      }
+      VertexEncoding encoding = make_encoding(format, min, max);
+      write_encoding(trifile, encoding);
+      for(size_t i = 0; i < count; ++i){
+        size_t v = vertices ? vertices[i] : i;
+        encode_vertex(trifile.reserve(stride), encoding, (pos[v] - mid_point)*scale, normal[v].data(), &uv[v*2]);
+      }
+    };
+    
+    if(split16){
+      // chunks take consecutive triangles
+      size_t first_triangle = 0;
+      for(const IndexChunk& chunk : chunks){
+        trifile.write_value((uint32_t)chunk.vertices.size());
+        trifile.write_value((uint32_t)chunk.indices.size());
+        trifile.write_value((uint32_t)sizeof(uint16_t));
+        write_vertices(chunk.vertices.size(), chunk.vertices.data());
+        trifile.write(chunk.indices.data(), chunk.indices.size()*sizeof(uint16_t));
+        if(chunk.indices.size() & 1)
+          trifile.write_value((uint16_t)0);
+        size_t triangles = chunk.indices.size()/3;
+        std::vector<uint32_t> keys(triangle_keys.begin() + first_triangle, triangle_keys.begin() + first_triangle + triangles);
+        write_ranges(trifile, draw_ranges(keys));
+        first_triangle += triangles;
+      }
+    } else {
+      uint32_t width = index_width(pos.size());
+      trifile.write_value((uint32_t)pos.size());
+      trifile.write_value((uint32_t)indecies.size());
+      trifile.write_value(width);
+      write_vertices(pos.size(), nullptr);
+      write_indices(trifile, indecies.data(), indecies.size(), width);
+      write_ranges(trifile, draw_ranges(triangle_keys));
+    }
+    
+    const float identity[12] = {1,0,0, 0,1,0, 0,0,1, 0,0,0};
+    for(size_t c = 0; c < mesh_count; ++c){
+      trifile.write_value((int32_t)-1);
+      trifile.write_value((int32_t)c);
+      trifile.write(identity, sizeof(identity));
+    }
+    write_material_table(trifile);
+    trifile.close();
+  }
+
+  void MeshImporter::build_instanced_scene(const Matrix4fList& world,
+                                           const std::unordered_map<const Node*, size_t>& node_index,
+                                           const Eigen::Matrix3f& rot3f,
+                                           bool y_up,
+                                           InstancedScene& scene){
+    scene.node_index = node_index;
+    scene.material_ids = material_ids();
+    for(auto& node : _nodes){
+      if(node->mesh && scene.mesh_index.emplace(node->mesh, (int32_t)scene.meshes.size()).second)
+        scene.meshes.push_back(node->mesh);
+    }
+    
+    // local sum and bounds once per mesh, instances only transform those. the centroid is exact,
+    // the bounds are the bounds of the transformed local boxes
+    const std::vector<const MeshSource*>& meshes = scene.meshes;
+    std::vector<InstancedScene::MeshStats>& stats = scene.stats;
+    stats.resize(meshes.size());
+    parallel_for(meshes.size(), [&](size_t m){
+      size_t count = meshes[m]->pos.size()/3;
+      Eigen::Map<const Eigen::Matrix3Xf> pos_src(meshes[m]->pos.data(), 3, count);
+      stats[m].sum = pos_src.cast<double>().rowwise().sum();
+      stats[m].min = count ? Eigen::Vector3f(pos_src.rowwise().minCoeff()) : Eigen::Vector3f::Zero();
+      stats[m].max = count ? Eigen::Vector3f(pos_src.rowwise().maxCoeff()) : Eigen::Vector3f::Zero();
+    });
+    
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+    size_t vertex_count = 0;
+    Eigen::Vector3f max = Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+    Eigen::Vector3f min = Eigen::Vector3f::Constant(fmax);
+    for(size_t n = 0; n < _nodes.size(); ++n){
+      const MeshSource* mesh = _nodes[n]->mesh;
+      if(!mesh || mesh->pos.empty())
+        continue;
+      const InstancedScene::MeshStats& stat = stats[scene.mesh_index[mesh]];
+      size_t count = mesh->pos.size()/3;
+      Eigen::Matrix3f linear = rot3f*world[n].block<3,3>(0,0);
+      Eigen::Vector3f translation = rot3f*world[n].block<3,1>(0,3);
+      sum += (linear.cast<double>()*stat.sum) + translation.cast<double>()*(double)count;
+      vertex_count += count;
+      for(int corner = 0; corner < 8; ++corner){
+        Eigen::Vector3f local((corner & 1) ? stat.max.x() : stat.min.x(),
+                              (corner & 2) ? stat.max.y() : stat.min.y(),
+                              (corner & 4) ? stat.max.z() : stat.min.z());
+        Eigen::Vector3f p = linear*local + translation;
+        max = max.cwiseMax(p);
+        min = min.cwiseMin(p);
+      }
+    }
+    
+    Eigen::Matrix4f& normalize = scene.normalize;
+    normalize = Eigen::Matrix4f::Identity();
+    normalize.block<3,3>(0,0) = rot3f;
+    if(vertex_count > 0){
+      Eigen::Vector3f mid_point = (sum/(double)vertex_count).cast<float>();
+      if(!y_up)
+        mid_point.z() = 0.0f;
+      else
+        mid_point.y() = 0.0f;
+      max -= mid_point;
+      min -= mid_point;
+      float length = (max - min).norm();
+      normalize.block<3,3>(0,0) = rot3f/length;
+      normalize.block<3,1>(0,3) = -mid_point/length;
+      
+      std::cout<< "max:" << max/length <<std::endl;
+      std::cout<< "min:" << min/length <<std::endl;
+    }
+  }
+  
+  TriNode MeshImporter::node_record(size_t n, const InstancedScene& scene) const{
+    const Node* node = _nodes[n].get();
+    TriNode record;
+    record.parent = node->parent ? (int32_t)scene.node_index.at(node->parent) : -1;
+    record.mesh = node->mesh ? scene.mesh_index.at(node->mesh) : -1;
+    Eigen::Matrix4f local = node->matrix.transpose();
+    if(!node->parent)
+      local = scene.normalize*local;
+    // 3x4 column major, the last column is the translation
+    for(int c = 0; c < 4; ++c){
+      for(int r = 0; r < 3; ++r){
+        record.local[c*3 + r] = local(r, c);
+      }
+    }
+    return record;
+  }
+  
+  // vertex i of a mesh source, quantized relative to the local bounds of the mesh
+  static void encode_mesh_vertex(const MeshSource* mesh, const VertexEncoding& encoding, size_t i, char* dst){
+    Eigen::Vector3f a_pos(mesh->pos[i*3], mesh->pos[i*3+1], mesh->pos[i*3+2]);
+    encode_vertex(dst, encoding, a_pos,
+                  mesh->normal.size() == mesh->pos.size() ? &mesh->normal[i*3] : nullptr,
+                  mesh->uv.size() >= (i+1)*2 ? &mesh->uv[i*2] : nullptr);
+  }
+
+  void MeshImporter::serialize_instanced(const std::string& file_path, const InstancedScene& scene, const SerializeOptions& options){
+    BlockWriter trifile(file_path);
+    trifile.write("TRI2", 4);
+    trifile.write_value((uint32_t)scene.meshes.size());
+    trifile.write_value((uint32_t)_nodes.size());
+    trifile.write_value((uint32_t)options.vertex_format);
+    trifile.write_value((uint32_t)_materials.size());
+    
+    size_t stride = vertex_stride(options.vertex_format);
+    for(size_t m = 0; m < scene.meshes.size(); ++m){
+      const MeshSource* mesh = scene.meshes[m];
+      size_t count = mesh->pos.size()/3;
+      uint32_t width = index_width(count);
+      trifile.write_value((uint32_t)count);
+      trifile.write_value((uint32_t)mesh->index.size());
+      trifile.write_value(width);
+      VertexEncoding encoding = make_encoding(options.vertex_format, scene.stats[m].min, scene.stats[m].max);
+      write_encoding(trifile, encoding);
+      for(size_t i = 0; i < count; ++i)
+        encode_mesh_vertex(mesh, encoding, i, trifile.reserve(stride));
+      write_indices(trifile, mesh->index.data(), mesh->index.size(), width);
+      write_ranges(trifile, draw_ranges(triangle_materials(mesh, mesh->face_material_idx, mesh->index.size()/3, scene.material_ids)));
+    }
+    
+    for(size_t n = 0; n < _nodes.size(); ++n)
+      trifile.write_value(node_record(n, scene));
+    write_material_table(trifile);
+    trifile.close();
+  }
+  
+  static void append(std::vector<char>& dst, const void* src, size_t size){
+    dst.insert(dst.end(), (const char*)src, (const char*)src + size);
+  }
+  
+  template<typename T>
+  static void append_value(std::vector<char>& dst, const T& value){
+    append(dst, &value, sizeof(T));
+  }
+  
+  static void append_string(std::vector<char>& dst, const std::string& value){
+    append_value(dst, (uint32_t)value.size());
+    append(dst, value.data(), value.size());
+  }
+  
+  // indices at width, padded to 4 bytes
+  static void append_indices(std::vector<char>& dst, const std::vector<uint32_t>& index, uint32_t width){
+    if(width == sizeof(uint32_t)){
+      append(dst, index.data(), index.size()*sizeof(uint32_t));
+      return;
+    }
+    for(uint32_t v : index)
+      append_value(dst, (uint16_t)v);
+    if(index.size() & 1)
+      append_value(dst, (uint16_t)0);
+  }
+  
+  void MeshImporter::serialize_container(const std::string& file_path, const InstancedScene& scene, const SerializeOptions& options){
+    AssetWriter writer(file_path);
+    size_t stride = vertex_stride(options.vertex_format);
+    
+    // meshes are encoded and compressed in parallel batches, so only a batch of payloads is held at once
+    size_t batch = 2*worker_count();
+    for(size_t first = 0; first < scene.meshes.size(); first += batch){
+      size_t count = std::min(batch, scene.meshes.size() - first);
+      std::vector<AssetIO::PackedChunk> chunks(4*count);
+      parallel_for(count, [&](size_t b){
+        size_t m = first + b;
+        const MeshSource* mesh = scene.meshes[m];
+        size_t vertex_count = mesh->pos.size()/3;
+        VertexEncoding encoding = make_encoding(options.vertex_format, scene.stats[m].min, scene.stats[m].max);
+        Eigen::Vector3f offset = encoding.format == VertexFormat::Float32 ? Eigen::Vector3f::Zero() : encoding.offset;
+        Eigen::Vector3f extent = encoding.format == VertexFormat::Float32 ? Eigen::Vector3f::Ones() : encoding.extent;
+        
+        std::vector<char> vertices;
+        vertices.reserve(8*sizeof(uint32_t) + vertex_count*stride);
+        append_value(vertices, (uint32_t)options.vertex_format);
+        append_value(vertices, (uint32_t)vertex_count);
+        append(vertices, offset.data(), sizeof(Eigen::Vector3f));
+        append(vertices, extent.data(), sizeof(Eigen::Vector3f));
+        size_t header = vertices.size();
+        vertices.resize(header + vertex_count*stride);
+        for(size_t i = 0; i < vertex_count; ++i)
+          encode_mesh_vertex(mesh, encoding, i, &vertices[header + i*stride]);
+        chunks[4*b] = AssetIO::pack(AssetIO::ChunkType::Vertices, (uint32_t)m, std::move(vertices), options.compression);
+        
+        uint32_t width = index_width(vertex_count);
+        size_t index_bytes = mesh->index.size()*width;
+        std::vector<char> indices;
+        indices.reserve(2*sizeof(uint32_t) + index_bytes + 2);
+        append_value(indices, width);
+        append_value(indices, (uint32_t)mesh->index.size());
+        append_indices(indices, mesh->index, width);
+        chunks[4*b + 1] = AssetIO::pack(AssetIO::ChunkType::Indices, (uint32_t)m, std::move(indices), options.compression);
+        
+        if(!mesh->lods.empty()){
+          std::vector<char> lods;
+          append_value(lods, (uint32_t)mesh->lods.size());
+          for(const MeshLod& lod : mesh->lods){
+            append_value(lods, lod.error);
+            append_value(lods, width);
+            append_value(lods, (uint32_t)lod.index.size());
+            append_indices(lods, lod.index, width);
+          }
+          chunks[4*b + 2] = AssetIO::pack(AssetIO::ChunkType::Lods, (uint32_t)m, std::move(lods), options.compression);
+        }
+        
+        std::vector<char> ranges;
+        append_value(ranges, (uint32_t)(1 + mesh->lods.size()));
+        for(size_t level = 0; level <= mesh->lods.size(); ++level){
+          const std::vector<uint32_t>& index = level ? mesh->lods[level-1].index : mesh->index;
+          const std::vector<int32_t>& face_material = level ? mesh->lods[level-1].face_material_idx : mesh->face_material_idx;
+          std::vector<DrawRange> level_ranges = draw_ranges(triangle_materials(mesh, face_material, index.size()/3, scene.material_ids));
+          append_value(ranges, (uint32_t)level_ranges.size());
+          append(ranges, level_ranges.data(), level_ranges.size()*sizeof(DrawRange));
+        }
+        chunks[4*b + 3] = AssetIO::pack(AssetIO::ChunkType::DrawRanges, (uint32_t)m, std::move(ranges), options.compression);
+      });
+      // the Lods slot of meshes without levels stays empty
+      for(const AssetIO::PackedChunk& chunk : chunks){
+        if(chunk.entry.raw_size > 0)
+          writer.write(chunk);
+      }
+    }
+    
+    std::vector<char> nodes;
+    nodes.reserve(_nodes.size()*sizeof(TriNode));
+    for(size_t n = 0; n < _nodes.size(); ++n)
+      append_value(nodes, node_record(n, scene));
+    writer.write(AssetIO::pack(AssetIO::ChunkType::Nodes, 0, std::move(nodes), options.compression));
+    
+    std::vector<char> materials;
+    append_value(materials, (uint32_t)_materials.size());
+    for(const auto& material : _materials){
+      append(materials, material->base_color, sizeof(material->base_color));
+      append_value(materials, material->opacity);
+      append_string(materials, material->name);
+      append_string(materials, material->base_color_map);
+    }
+    writer.write(AssetIO::pack(AssetIO::ChunkType::Materials, 0, std::move(materials), options.compression));
+    
+    // sorted so equal scenes give equal files
+    std::vector<std::string> texture_paths = texture_maps();
+    std::sort(texture_paths.begin(), texture_paths.end());
+    std::vector<char> textures;
+    append_value(textures, (uint32_t)texture_paths.size());
+    for(const std::string& path : texture_paths)
+      append_string(textures, path);
+    writer.write(AssetIO::pack(AssetIO::ChunkType::Textures, 0, std::move(textures), options.compression));
+    
+    writer.close();
+  }
+
+  void MeshImporter::serialize_to_file(const std::string& file_path, bool flattern, bool y_up, float rotatate_z, const SerializeOptions& options){
     
     std::vector<Eigen::Vector3f> pos;
     std::vector<Eigen::Vector3f> normal;
     std::vector<float> uv;
     std::vector<uint32_t> indecies;
+    // output position = (pos - mid_point)*scale
+    Eigen::Vector3f mid_point = Eigen::Vector3f::Zero();
+    float scale = 1.0f;
     
     Eigen::Matrix3f rot3f;
     rot3f = Eigen::AngleAxisf(0, Eigen::Vector3f::UnitX()) *
     Eigen::AngleAxisf(0, Eigen::Vector3f::UnitY()) *
     Eigen::AngleAxisf(rotatate_z, Eigen::Vector3f::UnitZ());
     
-    for(auto& node : _nodes){
-      Eigen::Matrix4f temp = node->matrix.transpose();
-      node->matrix = temp;
-    }
-    int node_c = 0;
-    for(auto node : _nodes){
+    // node matrices are stored row vector style, world transforms are column vector style.
+    // parents are always created before their children
+    Matrix4fList world(_nodes.size());
+    std::unordered_map<const Node*, size_t> node_index;
+    node_index.reserve(_nodes.size());
+    for(size_t i = 0; i < _nodes.size(); ++i){
+      const Node* node = _nodes[i].get();
+      node_index[node] = i;
+      world[i] = node->matrix.transpose();
       if(node->parent){
-        node->matrix = node->parent->matrix * node->matrix;
+        world[i] = world[node_index[node->parent]] * world[i];
       }
-      
-      ++node_c;
+    }
+    
+    if(!flattern || options.container){
+      InstancedScene scene;
+      build_instanced_scene(world, node_index, rot3f, y_up, scene);
+      if(options.container)
+        serialize_container(file_path, scene, options);
+      else
+        serialize_instanced(file_path, scene, options);
+      return;
+    }
+    
+    // phase 1: output offset of every mesh node (prefix sum)
+    // the z rotation is folded into the world matrix of every mesh node
+    struct FlatRange{
+      const Node* node;
+      Eigen::Matrix3f linear;
+      Eigen::Vector3f translation;
+      size_t vertex_offset;
+      size_t index_offset;
+    };
+    std::vector<FlatRange> ranges;
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+    for(size_t n = 0; n < _nodes.size(); ++n){
+      const Node* node = _nodes[n].get();
       if(node->mesh){
-        if(flattern){
-          const Eigen::Vector3f* pos_src = (const Eigen::Vector3f*)node->mesh->pos.data();
-          const Eigen::Vector3f* norm_src = (const Eigen::Vector3f*)node->mesh->normal.data();
-          const int* index = (const int*)node->mesh->index.data();
-          std::vector< Eigen::Vector3f> pos_temp(node->mesh->pos.size()/3);
-          std::vector< Eigen::Vector3f> norm_temp(node->mesh->normal.size()/3);
-          
-          Eigen::Vector4f temp;
-          Eigen::Vector3f ntemp;
-          for(size_t i = 0; i < node->mesh->pos.size()/3; ++i){
-        
-            temp = Eigen::Vector4f::Ones();
-            temp.head<3>() = pos_src[i];
-            pos_temp[i] = (node->matrix*temp).head<3>();
-            
-            ntemp = norm_src[i];
-            auto mat_3x3 = node->matrix.block<3,3>(0,0);
-            ntemp = mat_3x3*ntemp;
-            ntemp.normalize();
-            norm_temp[i] = ntemp;
-          }
-          
-          int offset = pos.size();
-          pos.insert( pos.end(), pos_temp.begin(), pos_temp.end() );
-          normal.insert( normal.end(),norm_temp.begin(), norm_temp.end() );
-          uv.insert(uv.end(), node->mesh->uv.begin(), node->mesh->uv.end() );
-          
-          std::vector<uint32_t> index_temp = node->mesh->index;
-          for(size_t i = 0; i < node->mesh->index.size(); ++i){
-            index_temp[i] += offset;
-          }
-          indecies.insert(indecies.end(),index_temp.begin(), index_temp.end());
-          
-        }
+        Eigen::Matrix3f linear = rot3f*world[n].block<3,3>(0,0);
+        Eigen::Vector3f translation = rot3f*world[n].block<3,1>(0,3);
+        ranges.push_back({node, linear, translation, vertex_count, index_count});
+        vertex_count += node->mesh->pos.size()/3;
+        index_count += node->mesh->index.size();
       }
     }
+    pos.resize(vertex_count);
+    normal.resize(vertex_count);
+    uv.resize(vertex_count*2);
+    indecies.resize(index_count);
     
-    Eigen::Vector3f max = Eigen::Vector3f(fmin,fmin,fmin);
-    Eigen::Vector3f min = Eigen::Vector3f(fmax,fmax,fmax);
+    // phase 2: transform fixed size chunks of every node in parallel, straight into the output.
+    // each chunk also reduces its sum and bounds while the data is in cache
+    const size_t chunk_size = 1 << 14;
+    struct FlatChunk{
+      const FlatRange* range;
+      size_t begin;
+      size_t end;
+      Eigen::Vector3d sum;
+      Eigen::Vector3f min;
+      Eigen::Vector3f max;
+    };
+    std::vector<FlatChunk> vertex_chunks;
+    std::vector<FlatChunk> index_chunks;
+    for(const FlatRange& range : ranges){
+      size_t num_vertices = range.node->mesh->pos.size()/3;
+      for(size_t i = 0; i < num_vertices; i += chunk_size)
+        vertex_chunks.push_back({&range, i, std::min(num_vertices, i + chunk_size), Eigen::Vector3d::Zero(), Eigen::Vector3f::Zero(), Eigen::Vector3f::Zero()});
+      size_t num_indices = range.node->mesh->index.size();
+      for(size_t i = 0; i < num_indices; i += chunk_size)
+        index_chunks.push_back({&range, i, std::min(num_indices, i + chunk_size), Eigen::Vector3d::Zero(), Eigen::Vector3f::Zero(), Eigen::Vector3f::Zero()});
+    }
     
-    if(flattern){
-      size_t vert_size = pos.size();
-      Eigen::Vector3f mid_point = Eigen::Vector3f::Zero();
-
+    parallel_for(vertex_chunks.size(), [&](size_t c){
+      FlatChunk& chunk = vertex_chunks[c];
+      const MeshSource* mesh = chunk.range->node->mesh;
+      size_t count = chunk.end - chunk.begin;
+      size_t dst = chunk.range->vertex_offset + chunk.begin;
       
-      for( Eigen::Vector3f& a_pos : pos ){
-        a_pos = rot3f*a_pos;
-      }
-      for( Eigen::Vector3f& a_norm : normal ){
-        a_norm = rot3f*a_norm;
+      Eigen::Map<const Eigen::Matrix3Xf> pos_src(&mesh->pos[chunk.begin*3], 3, count);
+      Eigen::Map<Eigen::Matrix3Xf> pos_dst(pos[dst].data(), 3, count);
+      pos_dst.noalias() = chunk.range->linear*pos_src;
+      pos_dst.colwise() += chunk.range->translation;
+      chunk.sum = pos_dst.cast<double>().rowwise().sum();
+      chunk.min = pos_dst.rowwise().minCoeff();
+      chunk.max = pos_dst.rowwise().maxCoeff();
+      
+      Eigen::Map<Eigen::Matrix3Xf> norm_dst(normal[dst].data(), 3, count);
+      if(mesh->normal.size() == mesh->pos.size()){
+        Eigen::Map<const Eigen::Matrix3Xf> norm_src(&mesh->normal[chunk.begin*3], 3, count);
+        norm_dst.noalias() = chunk.range->linear*norm_src;
+        // per column, Vector3f::normalize leaves degenerate zero normals alone instead of producing NaN
+        for(Eigen::Index v = 0; v < norm_dst.cols(); ++v)
+          norm_dst.col(v).normalize();
+      } else {
+        norm_dst.setZero();
       }
       
-      for( const Eigen::Vector3f& a_pos : pos ){
-        mid_point += a_pos;
+      // faces without texture coordinates leave uv short, those stay zero
+      if(mesh->uv.size() >= chunk.end*2)
+        std::copy(mesh->uv.begin() + chunk.begin*2, mesh->uv.begin() + chunk.end*2, uv.begin() + dst*2);
+    });
+    
+    // centroid and bounds from the chunk partials, recentering and scaling happens in the writers
+    if(vertex_count > 0){
+      Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+      Eigen::Vector3f max = Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+      Eigen::Vector3f min = Eigen::Vector3f::Constant(fmax);
+      for(const FlatChunk& chunk : vertex_chunks){
+        sum += chunk.sum;
+        max = max.cwiseMax(chunk.max);
+        min = min.cwiseMin(chunk.min);
       }
-      mid_point = mid_point/(float)vert_size;
+      mid_point = (sum/(double)vertex_count).cast<float>();
       if(!y_up)
         mid_point.z() = 0.0f;
       else
         mid_point.y() = 0.0f;
       
-      for(  Eigen::Vector3f& a_pos : pos ){
-        a_pos = a_pos - mid_point;
-        
-        max.x() = std::max(max.x(),a_pos.x());
-        max.y() = std::max(max.y(),a_pos.y());
-        max.z() = std::max(max.z(),a_pos.z());
-        min.x() = std::min(min.x(),a_pos.x());
-        min.y() = std::min(min.y(),a_pos.y());
-        min.z() = std::min(min.z(),a_pos.z());
-      }
+      max -= mid_point;
+      min -= mid_point;
       Eigen::Vector3f diff = max - min;
       float length = diff.norm();
-      
-      for(  Eigen::Vector3f& a_pos : pos ){
-        a_pos = a_pos/length;
-      }
+      scale = 1.0f/length;
       
       std::cout<< "max:" << max/length <<std::endl;
       std::cout<< "min:" << min/length <<std::endl;
     }
     
+    parallel_for(index_chunks.size(), [&](size_t c){
+      const FlatChunk& chunk = index_chunks[c];
+      const uint32_t* src = chunk.range->node->mesh->index.data();
+      uint32_t offset = (uint32_t)chunk.range->vertex_offset;
+      uint32_t* dst = &indecies[chunk.range->index_offset];
+      for(size_t i = chunk.begin; i < chunk.end; ++i)
+        dst[i] = src[i] + offset;
+    });
     
-
-    std::ofstream outfile;
-    outfile.open (file_path, std::ios::out | std::ios::trunc | std::ios::binary);
-    outfile << 'T' << 'R' << 'I' << 'S';
-    uint32_t uint_val = (uint32_t)(pos.size()*8);
-    outfile.write((char*)(&uint_val), sizeof(uint32_t));
-    
-   
-    
-    for(size_t i = 0; i < pos.size(); ++i){
-      outfile.write((char*)(&pos[i]), sizeof(Eigen::Vector3f));
-      outfile.write((char*)(&normal[i]), sizeof(Eigen::Vector3f));
-      outfile.write((char*)(&uv[i*2]), 2*sizeof(float));
-      
+    if(options.tri_v2 || options.index16 || options.vertex_format != VertexFormat::Float32){
+      // material of every output triangle, then one stable sort over all of them so every
+      // material becomes a single draw range
+      std::vector<uint32_t> triangle_keys(index_count/3);
+      MaterialIds ids = material_ids();
+      parallel_for(ranges.size(), [&](size_t r){
+        const MeshSource* mesh = ranges[r].node->mesh;
+        std::vector<uint32_t> keys = triangle_materials(mesh, mesh->face_material_idx, mesh->index.size()/3, ids);
+        std::copy(keys.begin(), keys.end(), triangle_keys.begin() + ranges[r].index_offset/3);
+      });
+      std::vector<uint32_t> order = radix_sort(triangle_keys);
+      std::vector<uint32_t> sorted_index(indecies.size());
+      std::vector<uint32_t> sorted_keys(triangle_keys.size());
+      parallel_for(order.size(), [&](size_t i){
+        uint32_t t = order[i];
+        sorted_index[i*3 + 0] = indecies[t*3 + 0];
+        sorted_index[i*3 + 1] = indecies[t*3 + 1];
+        sorted_index[i*3 + 2] = indecies[t*3 + 2];
+        sorted_keys[i] = triangle_keys[t];
+      }, chunk_size);
+      indecies = std::move(sorted_index);
+      write_flat_v2(file_path, pos, normal, uv, indecies, mid_point, scale, sorted_keys, options.index16, options.vertex_format);
+    } else {
+      write_tri(file_path, pos, normal, uv, indecies, mid_point, scale);
     }
     
-    uint_val = (uint32_t)indecies.size();
-    outfile.write((char*)(&uint_val), sizeof(uint32_t));
-    outfile.write((char*)indecies.data(), indecies.size()*sizeof(uint32_t));
-    outfile.close();
-    
     // write to PLY
-    
     size_t lastindex = file_path.find_last_of(".");
     std::string rawname = file_path.substr(0, lastindex);
     std::string plyname = rawname + ".ply";
-    
-    outfile.open (plyname, std::ios::out | std::ios::trunc );
-    outfile<<"ply"<<std::endl;
-    outfile<<"format ascii 1.0"<<std::endl;
-    outfile<<"element vertex "<< pos.size() <<std::endl;
-    outfile<<"property float x" << std::endl;
-    outfile<<"property float y" << std::endl;
-    outfile<<"property float z" << std::endl;
-    
-    outfile<<"element face " << uint_val/3 <<std::endl;
-    outfile<<"property list uchar int vertex_indices"<<std::endl;
-    outfile<<"end_header" << std::endl;
-    
-    for(size_t i = 0; i < pos.size(); ++i){
-      outfile<< pos[i].x() <<" "<< pos[i].y()<< " " << pos[i].z() << std::endl;
-    }
-    
-    for(size_t i = 0; i < indecies.size()/3; ++i){
-      outfile<< "3" <<" "<<indecies[i*3] <<" "<< indecies[i*3+1] << " " << indecies[i*3+2] << std::endl;
-    }
-    
-    outfile.close();
+    write_ply(plyname, pos, normal, uv, indecies, mid_point, scale, options);
   }
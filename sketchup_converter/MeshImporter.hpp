@@ -10,9 +10,31 @@
 #define MeshImporter_hpp
 #include <iostream>
 
+#include "AssetIO.hpp"
 #include "MeshImport.h"
+#include "MeshProcess.hpp"
+#include <Eigen/StdVector>
 #include <stdio.h>
+#include <unordered_map>
 using namespace trisetra;
+
+struct SerializeOptions{
+  // the .ply side output is binary little endian unless ply_ascii is set
+  bool ply_ascii = false;
+  bool ply_normals = false;
+  bool ply_uv = false;
+  // flattened output is split into chunks of at most 64K vertices with 16 bit indices,
+  // written as a .tri v2 with one identity node per chunk
+  bool index16 = false;
+  // quantized formats are only available in .tri v2, flattened output then is a v2 with identity nodes
+  VertexFormat vertex_format = VertexFormat::Float32;
+  // flattened output as a .tri v2 (material sorted draw ranges and material table) even for float vertices
+  bool tri_v2 = false;
+  // writes the instanced scene as a chunked container (see AssetIO) instead of a .tri, flattern is ignored
+  bool container = false;
+  AssetIO::Compression compression = AssetIO::Compression::None;
+};
+
 class MeshImporter : public MeshImport{
 public:
   MeshImporter() = default;
@@ -29,7 +51,7 @@ public:
   
   // indicate number of vertcies per face
   void add_face_descriptor(MeshSource* mesh,std::vector<uint8_t>&& vert_per_face) override;
-  // material_idx is used to access add_materials std::vector<std::shared_ptr<MaterialData>> material_data
+  // material_idx is used to access the mesh palette built by apply_material
   void add_face_material_idx(MeshSource* mesh,std::vector<int32_t>&& material_idx) override;
   
   
@@ -47,10 +69,95 @@ public:
   int  apply_material(MeshSource* mesh, const MaterialData* material) override;
   void add_mdl_path(const std::string& mdl_path) override;
   void add_texture_path(std::unordered_set<std::string>&&) override;
+  void remove_unreferenced_meshes() override;
+  
+  // welds duplicated vertices of every mesh source, see trisetra::weld_vertices
+  void weld_vertices(const WeldOptions& options);
+  // reorders triangles and vertices of every mesh source for the post transform cache and
+  // vertex fetch, reporting ACMR/ATVR before and after. triangles stay within their material
+  // runs, so after sort_by_material the reported order is the one written
+  void optimize_meshes(unsigned cache_size);
+  // builds the level of detail chain of every mesh source, see trisetra::generate_lods
+  void generate_lods(const LodOptions& options);
+  // sorts the triangles of every mesh source by material so each mesh draws with one range per material
+  void sort_by_material();
+  
+  typedef std::unordered_map<const MaterialData*, uint32_t> MaterialIds;
+  // DrawRange::material of faces without a material
+  static const uint32_t no_material = 0xFFFFFFFF;
+  // position of every material in the material table
+  MaterialIds material_ids() const;
+  
+  // triangles of every instance, as drawn
+  size_t triangle_count() const;
+  // distinct base_color_map files the materials reference, plus paths given to add_texture_path
+  std::vector<std::string> texture_maps() const;
   
-  void serialize_to_file(const std::string& file_path, bool flattern, bool y_up, float rotate_z);
+  // flat copy of everything an import produced (meshes, nodes, materials, texture paths) for handing
+  // a loaded scene to another process. returns the byte size, only measures when dst is null
+  size_t pack_scene(char* dst) const;
+  // replaces the scene with one written by pack_scene, throws if the data is truncated or inconsistent
+  void unpack_scene(const char* src, size_t size);
+  
+  // flattern writes every instance into one .tri vertex buffer (plus .ply), otherwise a .tri v2
+  // with each mesh source once and a node table referencing them is written
+  void serialize_to_file(const std::string& file_path, bool flattern, bool y_up, float rotate_z, const SerializeOptions& options = SerializeOptions());
   
 protected:
+  typedef std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>> Matrix4fList;
+  
+  // every mesh referenced by a node once, plus what the instanced writers need to place them
+  struct InstancedScene{
+    struct MeshStats{
+      Eigen::Vector3d sum;
+      Eigen::Vector3f min;
+      Eigen::Vector3f max;
+    };
+    std::vector<const MeshSource*> meshes;
+    std::unordered_map<const MeshSource*, int32_t> mesh_index;
+    std::unordered_map<const Node*, size_t> node_index;
+    MaterialIds material_ids;
+    // local sum and bounds per mesh
+    std::vector<MeshStats> stats;
+    // applied to the root nodes: p' = (rot3f*p - mid_point)*scale
+    Eigen::Matrix4f normalize;
+    
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+  
+  void build_instanced_scene(const Matrix4fList& world,
+                             const std::unordered_map<const Node*, size_t>& node_index,
+                             const Eigen::Matrix3f& rot3f,
+                             bool y_up,
+                             InstancedScene& scene);
+  // record of a node with its local transform, roots carry the normalization
+  TriNode node_record(size_t n, const InstancedScene& scene) const;
+  void write_material_table(BlockWriter& trifile) const;
+  void write_flat_v2(const std::string& file_path,
+                     const std::vector<Eigen::Vector3f>& pos,
+                     const std::vector<Eigen::Vector3f>& normal,
+                     const std::vector<float>& uv,
+                     const std::vector<uint32_t>& indecies,
+                     const Eigen::Vector3f& mid_point,
+                     float scale,
+                     const std::vector<uint32_t>& triangle_keys,
+                     bool split16,
+                     VertexFormat format) const;
+  
+  // .tri v2 layout, all little endian:
+  //   'T','R','I','2', uint32 mesh_count, uint32 node_count, uint32 vertex_format (VertexFormat), uint32 material_count
+  //   per mesh: uint32 vertex_count, uint32 index_count, uint32 index_width (2 if vertex_count <= 65536, else 4),
+  //             quantized formats only: float3 pos_offset, float3 pos_extent, pos = pos_offset + q/65535*pos_extent
+  //             vertex_count vertices in vertex_format, index_count * index_width bytes padded to 4 bytes,
+  //             uint32 range_count, range_count * DrawRange (uint32 first_index, index_count, material)
+  //   per node: int32 parent (-1 for roots), int32 mesh (-1 for none), float[12] local 3x4 column major
+  //   per material: float4 base_color, float opacity, name and base_color_map as uint32 length + bytes padded to 4
+  // DrawRange::material indexes the material table, no_material for faces without one
+  // positions and normals stay in mesh space, rotation and unit box normalization are folded into the root nodes
+  void serialize_instanced(const std::string& file_path, const InstancedScene& scene, const SerializeOptions& options);
+  // same scene as per mesh Vertices/Indices/Lods chunks plus Nodes, Materials and Textures
+  void serialize_container(const std::string& file_path, const InstancedScene& scene, const SerializeOptions& options);
+
   std::vector<std::shared_ptr<MeshSource>> _mesh_sources;
   std::vector<std::shared_ptr<Node>> _nodes;
   std::vector<std::shared_ptr<MaterialData>> _materials;
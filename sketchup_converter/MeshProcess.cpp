@@ -0,0 +1,925 @@
+//
+//  MeshProcess.cpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#include "MeshProcess.hpp"
+#include "Parallel.hpp"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+namespace trisetra {
+  
+  const unsigned LodOptions::max_levels;
+  
+  static uint64_t cell_key(int64_t x, int64_t y, int64_t z){
+    // 21 bits per axis, wrapping is fine as cells are only a hint and candidates are compared exactly
+    return ((uint64_t)(x & 0x1FFFFF) << 42) | ((uint64_t)(y & 0x1FFFFF) << 21) | (uint64_t)(z & 0x1FFFFF);
+  }
+  
+  static bool within(const float* a, const float* b, int count, float eps){
+    for(int i = 0; i < count; ++i){
+      if(std::abs(a[i] - b[i]) > eps)
+        return false;
+    }
+    return true;
+  }
+  
+  // remaps index, dropping triangles that collapsed along with their face material
+  static void remap_triangles(std::vector<uint32_t>& index, std::vector<int32_t>& face_material, const std::vector<uint32_t>& remap){
+    bool has_face_material = face_material.size() == index.size()/3;
+    size_t out_tri = 0;
+    for(size_t tri = 0; tri < index.size()/3; ++tri){
+      uint32_t i0 = remap[index[tri*3+0]];
+      uint32_t i1 = remap[index[tri*3+1]];
+      uint32_t i2 = remap[index[tri*3+2]];
+      if(i0 == i1 || i1 == i2 || i0 == i2)
+        continue;
+      
+      index[out_tri*3+0] = i0;
+      index[out_tri*3+1] = i1;
+      index[out_tri*3+2] = i2;
+      if(has_face_material)
+        face_material[out_tri] = face_material[tri];
+      ++out_tri;
+    }
+    index.resize(out_tri*3);
+    if(has_face_material)
+      face_material.resize(out_tri);
+  }
+  
+  size_t weld_vertices(MeshSource* mesh, const WeldOptions& options){
+    const size_t num_vertices = mesh->pos.size()/3;
+    if(num_vertices == 0 || mesh->normal.size() != mesh->pos.size())
+      return 0;
+    
+    bool has_uv = mesh->uv.size() == num_vertices*2;
+    if(!has_uv && !mesh->uv.empty())
+      return 0;
+    
+    const float inv_cell = 1.0f/std::max(options.position_eps, std::numeric_limits<float>::min());
+    
+    // cell -> first welded vertex, chained through next
+    std::unordered_map<uint64_t, uint32_t> cells;
+    cells.reserve(num_vertices);
+    std::vector<uint32_t> next;
+    next.reserve(num_vertices);
+    std::vector<uint32_t> remap(num_vertices);
+    
+    std::vector<float> pos;
+    std::vector<float> normal;
+    std::vector<float> uv;
+    pos.reserve(mesh->pos.size());
+    normal.reserve(mesh->normal.size());
+    uv.reserve(mesh->uv.size());
+    
+    const uint32_t invalid = std::numeric_limits<uint32_t>::max();
+    for(size_t i = 0; i < num_vertices; ++i){
+      const float* p = &mesh->pos[i*3];
+      const float* n = &mesh->normal[i*3];
+      const float* t = has_uv ? &mesh->uv[i*2] : nullptr;
+      int64_t cx = (int64_t)std::floor(p[0]*inv_cell);
+      int64_t cy = (int64_t)std::floor(p[1]*inv_cell);
+      int64_t cz = (int64_t)std::floor(p[2]*inv_cell);
+      
+      // a vertex within eps can only live in the 27 surrounding cells
+      uint32_t found = invalid;
+      for(int dx = -1; dx <= 1 && found == invalid; ++dx){
+        for(int dy = -1; dy <= 1 && found == invalid; ++dy){
+          for(int dz = -1; dz <= 1 && found == invalid; ++dz){
+            auto it = cells.find(cell_key(cx+dx, cy+dy, cz+dz));
+            if(it == cells.end())
+              continue;
+            for(uint32_t c = it->second; c != invalid; c = next[c]){
+              if(within(p, &pos[c*3], 3, options.position_eps) &&
+                 within(n, &normal[c*3], 3, options.normal_eps) &&
+                 (!has_uv || within(t, &uv[c*2], 2, options.uv_eps))){
+                found = c;
+                break;
+              }
+            }
+          }
+        }
+      }
+      
+      if(found == invalid){
+        found = (uint32_t)next.size();
+        pos.insert(pos.end(), p, p+3);
+        normal.insert(normal.end(), n, n+3);
+        if(has_uv)
+          uv.insert(uv.end(), t, t+2);
+        
+        auto inserted = cells.emplace(cell_key(cx, cy, cz), found);
+        next.push_back(inserted.second ? invalid : inserted.first->second);
+        inserted.first->second = found;
+      }
+      remap[i] = found;
+    }
+    
+    remap_triangles(mesh->index, mesh->face_material_idx, remap);
+    for(MeshLod& lod : mesh->lods)
+      remap_triangles(lod.index, lod.face_material_idx, remap);
+    
+    size_t removed = num_vertices - next.size();
+    mesh->pos = std::move(pos);
+    mesh->normal = std::move(normal);
+    mesh->uv = std::move(uv);
+    return removed;
+  }
+  
+  std::vector<uint32_t> radix_sort(const std::vector<uint32_t>& keys){
+    const size_t count = keys.size();
+    std::vector<uint32_t> order(count);
+    for(size_t i = 0; i < count; ++i)
+      order[i] = (uint32_t)i;
+    if(count == 0)
+      return order;
+    std::vector<uint32_t> scratch(count);
+    uint32_t max_key = *std::max_element(keys.begin(), keys.end());
+    
+    const size_t block = 1 << 16;
+    const size_t blocks = (count + block - 1)/block;
+    std::vector<std::array<size_t, 256>> histograms(blocks);
+    for(int shift = 0; shift < 32 && (max_key >> shift) != 0; shift += 8){
+      parallel_for(blocks, [&](size_t b){
+        std::array<size_t, 256>& histogram = histograms[b];
+        histogram.fill(0);
+        for(size_t i = b*block; i < std::min(count, (b+1)*block); ++i)
+          ++histogram[(keys[order[i]] >> shift) & 0xFF];
+      });
+      // digit major, block minor offsets keep equal digits in block order, which makes the pass stable
+      size_t sum = 0;
+      for(size_t digit = 0; digit < 256; ++digit){
+        for(size_t b = 0; b < blocks; ++b){
+          size_t n = histograms[b][digit];
+          histograms[b][digit] = sum;
+          sum += n;
+        }
+      }
+      parallel_for(blocks, [&](size_t b){
+        std::array<size_t, 256>& offsets = histograms[b];
+        for(size_t i = b*block; i < std::min(count, (b+1)*block); ++i)
+          scratch[offsets[(keys[order[i]] >> shift) & 0xFF]++] = order[i];
+      });
+      order.swap(scratch);
+    }
+    return order;
+  }
+  
+  std::vector<DrawRange> draw_ranges(const std::vector<uint32_t>& triangle_keys){
+    std::vector<DrawRange> ranges;
+    for(size_t t = 0; t < triangle_keys.size(); ++t){
+      if(ranges.empty() || ranges.back().material != triangle_keys[t])
+        ranges.push_back({(uint32_t)(t*3), 0, triangle_keys[t]});
+      ranges.back().index_count += 3;
+    }
+    return ranges;
+  }
+  
+  static void sort_triangles(std::vector<uint32_t>& index, std::vector<int32_t>& face_material){
+    const size_t num_triangles = index.size()/3;
+    if(face_material.size() != num_triangles)
+      return;
+    // faces without a material sort last
+    int32_t no_material = 0;
+    for(int32_t material : face_material)
+      no_material = std::max(no_material, material + 1);
+    std::vector<uint32_t> keys(num_triangles);
+    for(size_t t = 0; t < num_triangles; ++t)
+      keys[t] = (uint32_t)(face_material[t] < 0 ? no_material : face_material[t]);
+    std::vector<uint32_t> order = radix_sort(keys);
+    
+    std::vector<uint32_t> new_index(index.size());
+    std::vector<int32_t> new_face_material(num_triangles);
+    for(size_t i = 0; i < num_triangles; ++i){
+      uint32_t t = order[i];
+      new_index[i*3 + 0] = index[t*3 + 0];
+      new_index[i*3 + 1] = index[t*3 + 1];
+      new_index[i*3 + 2] = index[t*3 + 2];
+      new_face_material[i] = face_material[t];
+    }
+    index = std::move(new_index);
+    face_material = std::move(new_face_material);
+  }
+  
+  void sort_by_material(MeshSource* mesh){
+    sort_triangles(mesh->index, mesh->face_material_idx);
+    for(MeshLod& lod : mesh->lods)
+      sort_triangles(lod.index, lod.face_material_idx);
+  }
+  
+  // symmetric 4x4 error quadric, sum of weighted squared plane distances
+  struct Quadric{
+    double xx = 0, xy = 0, xz = 0, xw = 0;
+    double yy = 0, yz = 0, yw = 0;
+    double zz = 0, zw = 0;
+    double ww = 0;
+    double weight = 0;
+    
+    void add_plane(double nx, double ny, double nz, double d, double w){
+      xx += w*nx*nx; xy += w*nx*ny; xz += w*nx*nz; xw += w*nx*d;
+      yy += w*ny*ny; yz += w*ny*nz; yw += w*ny*d;
+      zz += w*nz*nz; zw += w*nz*d;
+      ww += w*d*d;
+      weight += w;
+    }
+    
+    void add(const Quadric& q){
+      xx += q.xx; xy += q.xy; xz += q.xz; xw += q.xw;
+      yy += q.yy; yz += q.yz; yw += q.yw;
+      zz += q.zz; zw += q.zw;
+      ww += q.ww;
+      weight += q.weight;
+    }
+    
+    // mean squared distance of p to the accumulated planes
+    double error(const float* p) const{
+      double x = p[0], y = p[1], z = p[2];
+      double e = xx*x*x + 2*xy*x*y + 2*xz*x*z + 2*xw*x
+               + yy*y*y + 2*yz*y*z + 2*yw*y
+               + zz*z*z + 2*zw*z
+               + ww;
+      return weight > 0 ? std::max(e, 0.0)/weight : 0.0;
+    }
+  };
+  
+  static void cross(const float* a, const float* b, const float* c, double* n){
+    double e0[3] = {(double)b[0] - a[0], (double)b[1] - a[1], (double)b[2] - a[2]};
+    double e1[3] = {(double)c[0] - a[0], (double)c[1] - a[1], (double)c[2] - a[2]};
+    n[0] = e0[1]*e1[2] - e0[2]*e1[1];
+    n[1] = e0[2]*e1[0] - e0[0]*e1[2];
+    n[2] = e0[0]*e1[1] - e0[1]*e1[0];
+  }
+  
+  enum VertexKind : uint8_t{
+    Manifold,
+    Border,
+    Locked,
+  };
+  
+  // one simplification level: collapses edges of index in passes of independent collapses until the
+  // triangle count reaches target_index_count or every remaining collapse costs more than max_error.
+  // collapses work on positions, every copy of a position moves at once so splits never crack open.
+  // copies that only differ in their normal are interchangeable, each corner takes the copy of the
+  // target whose normal is closest. a wedge is a uv chart and material around a position, a position
+  // with two wedges sits on a seam and only slides along it, every wedge onto the target's copy on its
+  // side. error receives the largest distance introduced
+  static void simplify_level(const MeshSource& mesh,
+                             const std::vector<uint32_t>& index,
+                             const std::vector<int32_t>& face_material,
+                             size_t target_index_count,
+                             float max_error,
+                             MeshLod& lod){
+    const std::vector<float>& pos = mesh.pos;
+    const size_t num_vertices = pos.size()/3;
+    const size_t num_triangles = index.size()/3;
+    bool has_face_material = face_material.size() == num_triangles;
+    bool has_uv = mesh.uv.size() == num_vertices*2;
+    bool has_normal = mesh.normal.size() == pos.size();
+    
+    // copies of a position share a position id, copies that also share the uv an attribute id
+    std::vector<uint32_t> by_position(num_vertices);
+    for(size_t v = 0; v < num_vertices; ++v)
+      by_position[v] = (uint32_t)v;
+    auto attributes = [&](uint32_t v){
+      return std::array<float, 5>{pos[v*3], pos[v*3 + 1], pos[v*3 + 2],
+                                  has_uv ? mesh.uv[v*2] : 0.0f, has_uv ? mesh.uv[v*2 + 1] : 0.0f};
+    };
+    std::sort(by_position.begin(), by_position.end(), [&](uint32_t a, uint32_t b){
+      return attributes(a) < attributes(b);
+    });
+    std::vector<uint32_t> position_id(num_vertices);
+    std::vector<uint32_t> attribute_id(num_vertices);
+    for(size_t i = 0; i < num_vertices; ++i){
+      uint32_t v = by_position[i];
+      uint32_t previous = i > 0 ? by_position[i-1] : v;
+      std::array<float, 5> key = attributes(v);
+      std::array<float, 5> previous_key = attributes(previous);
+      bool same_position = i > 0 && std::equal(key.begin(), key.begin() + 3, previous_key.begin());
+      position_id[v] = same_position ? position_id[previous] : v;
+      attribute_id[v] = i > 0 && key == previous_key ? attribute_id[previous] : v;
+    }
+    auto wedge = [&](const std::vector<uint32_t>& triangles, const std::vector<int32_t>& materials, size_t corner){
+      int32_t material = materials.size()*3 == triangles.size() ? materials[corner/3] : 0;
+      return ((uint64_t)attribute_id[triangles[corner]] << 32) | (uint32_t)material;
+    };
+    
+    // wedges around each position. collapses only hand a position the wedges of its target, so the
+    // lists stay valid for the whole level
+    std::vector<std::pair<uint32_t, uint64_t>> position_wedges(index.size());
+    for(size_t i = 0; i < index.size(); ++i)
+      position_wedges[i] = {position_id[index[i]], wedge(index, face_material, i)};
+    std::sort(position_wedges.begin(), position_wedges.end());
+    position_wedges.erase(std::unique(position_wedges.begin(), position_wedges.end()), position_wedges.end());
+    std::vector<uint32_t> wedge_offsets(num_vertices + 1, 0);
+    for(const auto& entry : position_wedges)
+      ++wedge_offsets[entry.first + 1];
+    for(size_t v = 0; v < num_vertices; ++v)
+      wedge_offsets[v+1] += wedge_offsets[v];
+    
+    // directed edges between positions with the wedges at both ends, an edge without its opposite
+    // is an open border, one whose opposite has other wedges a seam
+    struct Edge{
+      uint32_t count = 0;
+      uint64_t wedge_a = 0;
+      uint64_t wedge_b = 0;
+    };
+    auto edge_key = [&](uint32_t a, uint32_t b){
+      return ((uint64_t)a << 32) | b;
+    };
+    std::unordered_map<uint64_t, Edge> edges;
+    edges.reserve(index.size());
+    for(size_t t = 0; t < num_triangles; ++t){
+      for(int e = 0; e < 3; ++e){
+        Edge& edge = edges[edge_key(position_id[index[t*3 + e]], position_id[index[t*3 + (e+1)%3]])];
+        if(edge.count++ == 0){
+          edge.wedge_a = wedge(index, face_material, t*3 + e);
+          edge.wedge_b = wedge(index, face_material, t*3 + (e+1)%3);
+        }
+      }
+    }
+    auto is_border = [&](uint32_t a, uint32_t b){
+      return edges.find(edge_key(b, a)) == edges.end() || edges.find(edge_key(a, b)) == edges.end();
+    };
+    auto is_seam = [&](uint32_t a, uint32_t b){
+      auto ab = edges.find(edge_key(a, b));
+      auto ba = edges.find(edge_key(b, a));
+      return ab != edges.end() && ba != edges.end() &&
+             (ab->second.wedge_a != ba->second.wedge_b || ab->second.wedge_b != ba->second.wedge_a);
+    };
+    
+    // kinds by position id
+    std::vector<uint8_t> kind(num_vertices, Manifold);
+    for(size_t t = 0; t < num_triangles; ++t){
+      for(int e = 0; e < 3; ++e){
+        uint32_t a = position_id[index[t*3 + e]];
+        uint32_t b = position_id[index[t*3 + (e+1)%3]];
+        auto it = edges.find(edge_key(a, b));
+        auto opposite = edges.find(edge_key(b, a));
+        if(it->second.count > 1 || (opposite != edges.end() && opposite->second.count > 1)){
+          kind[a] = Locked;
+          kind[b] = Locked;
+        } else if(opposite == edges.end()){
+          for(uint32_t v : {a, b}){
+            if(kind[v] == Manifold)
+              kind[v] = Border;
+          }
+        }
+      }
+    }
+    // corners where three wedges meet, or a seam meets a border, stay
+    for(size_t v = 0; v < num_vertices; ++v){
+      uint32_t wedges = wedge_offsets[v+1] - wedge_offsets[v];
+      if(wedges > 2 || (wedges > 1 && kind[v] == Border))
+        kind[v] = Locked;
+    }
+    
+    // area weighted face planes by position id, open borders and seams add a perpendicular plane through the edge
+    std::vector<Quadric> quadrics(num_vertices);
+    for(size_t t = 0; t < num_triangles; ++t){
+      const uint32_t* tri = &index[t*3];
+      double n[3];
+      cross(&pos[tri[0]*3], &pos[tri[1]*3], &pos[tri[2]*3], n);
+      double length = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      if(length == 0.0)
+        continue;
+      n[0] /= length; n[1] /= length; n[2] /= length;
+      const float* p0 = &pos[tri[0]*3];
+      double d = -(n[0]*p0[0] + n[1]*p0[1] + n[2]*p0[2]);
+      for(int c = 0; c < 3; ++c)
+        quadrics[position_id[tri[c]]].add_plane(n[0], n[1], n[2], d, 0.5*length);
+      
+      for(int e = 0; e < 3; ++e){
+        uint32_t a = position_id[tri[e]];
+        uint32_t b = position_id[tri[(e+1)%3]];
+        if(!is_border(a, b) && !is_seam(a, b))
+          continue;
+        const float* pa = &pos[a*3];
+        const float* pb = &pos[b*3];
+        double edge[3] = {(double)pb[0] - pa[0], (double)pb[1] - pa[1], (double)pb[2] - pa[2]};
+        double m[3] = {edge[1]*n[2] - edge[2]*n[1], edge[2]*n[0] - edge[0]*n[2], edge[0]*n[1] - edge[1]*n[0]};
+        double m_length = std::sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+        if(m_length == 0.0)
+          continue;
+        m[0] /= m_length; m[1] /= m_length; m[2] /= m_length;
+        double md = -(m[0]*pa[0] + m[1]*pa[1] + m[2]*pa[2]);
+        double weight = edge[0]*edge[0] + edge[1]*edge[1] + edge[2]*edge[2];
+        quadrics[a].add_plane(m[0], m[1], m[2], md, weight);
+        quadrics[b].add_plane(m[0], m[1], m[2], md, weight);
+      }
+    }
+    
+    lod.index = index;
+    lod.face_material_idx = has_face_material ? face_material : std::vector<int32_t>();
+    double max_cost = (double)max_error*max_error;
+    double worst = 0.0;
+    
+    struct Collapse{
+      double cost;
+      uint32_t from;
+      uint32_t to;
+    };
+    // copy of the target position taking the corners of one wedge of the collapsing position
+    struct Candidate{
+      uint64_t wedge;
+      uint32_t vertex;
+    };
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> offsets(num_vertices + 1);
+    std::vector<uint32_t> adjacency;
+    std::vector<bool> touched(num_vertices);
+    std::vector<uint32_t> ring_from;
+    std::vector<uint32_t> ring_to;
+    std::vector<Candidate> candidates;
+    std::vector<uint32_t> next;
+    
+    while(lod.index.size() > target_index_count){
+      const std::vector<uint32_t>& current = lod.index;
+      size_t triangles = current.size()/3;
+      
+      // position -> triangles
+      std::fill(offsets.begin(), offsets.end(), 0);
+      for(uint32_t v : current)
+        ++offsets[position_id[v]+1];
+      for(size_t v = 0; v < num_vertices; ++v)
+        offsets[v+1] += offsets[v];
+      adjacency.resize(current.size());
+      {
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for(size_t i = 0; i < current.size(); ++i)
+          adjacency[fill[position_id[current[i]]]++] = (uint32_t)(i/3);
+      }
+      
+      collapses.clear();
+      for(size_t t = 0; t < triangles; ++t){
+        for(int e = 0; e < 6; ++e){
+          uint32_t from = position_id[current[t*3 + e%3]];
+          uint32_t to = position_id[current[t*3 + (e%3 + (e < 3 ? 1 : 2))%3]];
+          if(kind[from] == Locked)
+            continue;
+          if(kind[from] == Border && (kind[to] == Manifold || !is_border(from, to)))
+            continue;
+          if(wedge_offsets[from+1] - wedge_offsets[from] > 1 && !is_seam(from, to))
+            continue;
+          double cost = quadrics[from].error(&pos[to*3]);
+          if(cost <= max_cost)
+            collapses.push_back({cost, from, to});
+        }
+      }
+      std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b){
+        return a.cost < b.cost || (a.cost == b.cost && (a.from < b.from || (a.from == b.from && a.to < b.to)));
+      });
+      
+      next = current;
+      std::fill(touched.begin(), touched.end(), false);
+      size_t accepted = 0;
+      for(const Collapse& collapse : collapses){
+        if(triangles*3 <= target_index_count)
+          break;
+        uint32_t from = collapse.from;
+        uint32_t to = collapse.to;
+        if(touched[from] || touched[to])
+          continue;
+        
+        // no triangle around from may flip or degenerate, and the link condition must hold:
+        // the only neighbours from and to share are the apexes of the triangles on their edge
+        size_t removed = 0;
+        bool valid = true;
+        ring_from.clear();
+        ring_to.clear();
+        candidates.clear();
+        for(uint32_t a = offsets[from]; a < offsets[from+1] && valid; ++a){
+          size_t t = adjacency[a];
+          const uint32_t* tri = &current[t*3];
+          int corner_from = -1;
+          int corner_to = -1;
+          for(int c = 0; c < 3; ++c){
+            uint32_t p = position_id[tri[c]];
+            if(p == from)
+              corner_from = c;
+            else if(p == to)
+              corner_to = c;
+            else
+              ring_from.push_back(p);
+          }
+          if(corner_to >= 0){
+            candidates.push_back({wedge(current, lod.face_material_idx, t*3 + corner_from), tri[corner_to]});
+            ++removed;
+            continue;
+          }
+          const float* p[3];
+          const float* q[3];
+          for(int c = 0; c < 3; ++c){
+            p[c] = &pos[tri[c]*3];
+            q[c] = c == corner_from ? &pos[to*3] : p[c];
+          }
+          double n0[3];
+          double n1[3];
+          cross(p[0], p[1], p[2], n0);
+          cross(q[0], q[1], q[2], n1);
+          double dot = n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2];
+          double l0 = n0[0]*n0[0] + n0[1]*n0[1] + n0[2]*n0[2];
+          double l1 = n1[0]*n1[0] + n1[1]*n1[1] + n1[2]*n1[2];
+          if(l1 <= 1e-12*l0 || dot <= 0.25*std::sqrt(l0*l1))
+            valid = false;
+        }
+        if(!valid || removed == 0)
+          continue;
+        // every wedge of from needs a copy of to on its side of the edge
+        for(uint32_t w = wedge_offsets[from]; w < wedge_offsets[from+1] && valid; ++w){
+          valid = std::any_of(candidates.begin(), candidates.end(), [&](const Candidate& candidate){
+            return candidate.wedge == position_wedges[w].second;
+          });
+        }
+        if(!valid)
+          continue;
+        for(uint32_t a = offsets[to]; a < offsets[to+1]; ++a){
+          const uint32_t* tri = &current[adjacency[a]*3];
+          for(int c = 0; c < 3; ++c){
+            uint32_t p = position_id[tri[c]];
+            if(p != to && p != from)
+              ring_to.push_back(p);
+          }
+        }
+        std::sort(ring_from.begin(), ring_from.end());
+        ring_from.erase(std::unique(ring_from.begin(), ring_from.end()), ring_from.end());
+        std::sort(ring_to.begin(), ring_to.end());
+        ring_to.erase(std::unique(ring_to.begin(), ring_to.end()), ring_to.end());
+        size_t shared = 0;
+        for(uint32_t v : ring_from)
+          shared += std::binary_search(ring_to.begin(), ring_to.end(), v) ? 1 : 0;
+        if(shared != removed)
+          continue;
+        
+        // every corner on from moves to the candidate of its wedge with the closest normal
+        for(uint32_t a = offsets[from]; a < offsets[from+1]; ++a){
+          size_t t = adjacency[a];
+          for(int c = 0; c < 3; ++c){
+            size_t corner = t*3 + c;
+            if(position_id[current[corner]] != from)
+              continue;
+            uint64_t corner_wedge = wedge(current, lod.face_material_idx, corner);
+            const float* normal = has_normal ? &mesh.normal[current[corner]*3] : nullptr;
+            float best = -std::numeric_limits<float>::infinity();
+            for(const Candidate& candidate : candidates){
+              if(candidate.wedge != corner_wedge)
+                continue;
+              const float* candidate_normal = has_normal ? &mesh.normal[candidate.vertex*3] : nullptr;
+              float dot = normal ? normal[0]*candidate_normal[0] + normal[1]*candidate_normal[1] + normal[2]*candidate_normal[2] : 0.0f;
+              if(dot > best){
+                best = dot;
+                next[corner] = candidate.vertex;
+              }
+            }
+          }
+        }
+        quadrics[to].add(quadrics[from]);
+        touched[from] = true;
+        touched[to] = true;
+        for(uint32_t a = offsets[from]; a < offsets[from+1]; ++a){
+          const uint32_t* tri = &current[adjacency[a]*3];
+          for(int c = 0; c < 3; ++c)
+            touched[position_id[tri[c]]] = true;
+        }
+        triangles -= removed;
+        worst = std::max(worst, collapse.cost);
+        ++accepted;
+      }
+      if(accepted == 0)
+        break;
+      // drop the triangles that collapsed onto a single position
+      bool has_lod_material = lod.face_material_idx.size()*3 == next.size();
+      size_t out_tri = 0;
+      for(size_t t = 0; t < next.size()/3; ++t){
+        uint32_t p0 = position_id[next[t*3]];
+        uint32_t p1 = position_id[next[t*3 + 1]];
+        uint32_t p2 = position_id[next[t*3 + 2]];
+        if(p0 == p1 || p1 == p2 || p0 == p2)
+          continue;
+        std::copy(&next[t*3], &next[t*3] + 3, &next[out_tri*3]);
+        if(has_lod_material)
+          lod.face_material_idx[out_tri] = lod.face_material_idx[t];
+        ++out_tri;
+      }
+      next.resize(out_tri*3);
+      if(has_lod_material)
+        lod.face_material_idx.resize(out_tri);
+      lod.index.swap(next);
+    }
+    lod.error = (float)std::sqrt(worst);
+  }
+  
+  size_t generate_lods(MeshSource* mesh, const LodOptions& options){
+    mesh->lods.clear();
+    const size_t num_vertices = mesh->pos.size()/3;
+    const unsigned levels = std::min(options.levels, LodOptions::max_levels);
+    if(num_vertices == 0 || mesh->index.size() < 3 || levels == 0)
+      return 0;
+    
+    Eigen::Map<const Eigen::Matrix3Xf> pos(mesh->pos.data(), 3, num_vertices);
+    float diagonal = (pos.rowwise().maxCoeff() - pos.rowwise().minCoeff()).norm();
+    float budget = options.max_error*diagonal;
+    
+    // each level simplifies the one before, its error bounded by the sum along the chain
+    mesh->lods.reserve(levels);
+    float error = 0.0f;
+    for(unsigned level = 0; level < levels && error < budget; ++level){
+      const std::vector<uint32_t>& index = level ? mesh->lods.back().index : mesh->index;
+      const std::vector<int32_t>& face_material = level ? mesh->lods.back().face_material_idx : mesh->face_material_idx;
+      size_t target = (size_t)(index.size()/3*options.ratio)*3;
+      
+      MeshLod lod;
+      simplify_level(*mesh, index, face_material, target, budget - error, lod);
+      // not worth a level
+      if(lod.index.empty() || lod.index.size() > index.size()*0.95f)
+        break;
+      error += lod.error;
+      lod.error = error;
+      mesh->lods.push_back(std::move(lod));
+    }
+    return mesh->lods.size();
+  }
+  
+  uint16_t float_to_half(float value){
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+    
+    if(((bits >> 23) & 0xFF) == 0xFF)  // inf, nan
+      return (uint16_t)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+    if(exponent >= 31)  // overflow
+      return (uint16_t)(sign | 0x7C00);
+    if(exponent <= 0){  // subnormal or zero
+      if(exponent < -10)
+        return (uint16_t)sign;
+      mantissa |= 0x800000;
+      uint32_t shift = (uint32_t)(14 - exponent);
+      uint32_t half = mantissa >> shift;
+      uint32_t rest = mantissa & ((1u << shift) - 1);
+      uint32_t halfway = 1u << (shift - 1);
+      if(rest > halfway || (rest == halfway && (half & 1)))
+        ++half;
+      return (uint16_t)(sign | half);
+    }
+    
+    uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    // carrying into the exponent is the correct rounding, up to inf
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+      ++half;
+    return (uint16_t)half;
+  }
+  
+  void encode_octahedral(const float* normal, int bits, uint32_t* out){
+    float l1 = std::abs(normal[0]) + std::abs(normal[1]) + std::abs(normal[2]);
+    float x = l1 > 0.0f ? normal[0]/l1 : 0.0f;
+    float y = l1 > 0.0f ? normal[1]/l1 : 0.0f;
+    // lower hemisphere folds over the diagonals
+    if(normal[2] < 0.0f){
+      float fx = (1.0f - std::abs(y))*(x >= 0.0f ? 1.0f : -1.0f);
+      float fy = (1.0f - std::abs(x))*(y >= 0.0f ? 1.0f : -1.0f);
+      x = fx;
+      y = fy;
+    }
+    float max_value = (float)((1u << bits) - 1);
+    out[0] = (uint32_t)std::lround((std::min(std::max(x, -1.0f), 1.0f)*0.5f + 0.5f)*max_value);
+    out[1] = (uint32_t)std::lround((std::min(std::max(y, -1.0f), 1.0f)*0.5f + 0.5f)*max_value);
+  }
+  
+  std::vector<IndexChunk> split_index16(const std::vector<uint32_t>& indices, size_t vertex_count){
+    const size_t max_vertices = 1 << 16;
+    std::vector<IndexChunk> chunks;
+    // local index of every source vertex in the current chunk, stamped with the chunk number
+    std::vector<uint32_t> local(vertex_count);
+    std::vector<uint32_t> stamp(vertex_count, std::numeric_limits<uint32_t>::max());
+    
+    for(size_t tri = 0; tri < indices.size()/3; ++tri){
+      const uint32_t* corner = &indices[tri*3];
+      uint32_t current = (uint32_t)chunks.size() - 1;
+      size_t new_vertices = 0;
+      if(!chunks.empty()){
+        for(int i = 0; i < 3; ++i)
+          new_vertices += stamp[corner[i]] != current ? 1 : 0;
+      }
+      if(chunks.empty() || chunks.back().vertices.size() + new_vertices > max_vertices){
+        chunks.emplace_back();
+        current = (uint32_t)chunks.size() - 1;
+      }
+      
+      IndexChunk& chunk = chunks.back();
+      for(int i = 0; i < 3; ++i){
+        uint32_t v = corner[i];
+        if(stamp[v] != current){
+          stamp[v] = current;
+          local[v] = (uint32_t)chunk.vertices.size();
+          chunk.vertices.push_back(v);
+        }
+        chunk.indices.push_back((uint16_t)local[v]);
+      }
+    }
+    return chunks;
+  }
+  
+  VertexCacheStats measure_vertex_cache(const std::vector<uint32_t>& indices, size_t vertex_count, unsigned cache_size){
+    VertexCacheStats stats;
+    stats.triangles = indices.size()/3;
+    // a vertex is in the FIFO while fewer than cache_size misses happened since it was loaded
+    std::vector<size_t> loaded_at(vertex_count, 0);
+    std::vector<bool> referenced(vertex_count, false);
+    for(uint32_t v : indices){
+      if(!referenced[v]){
+        referenced[v] = true;
+        ++stats.vertices;
+      }
+      if(loaded_at[v] == 0 || stats.misses - loaded_at[v] >= cache_size){
+        ++stats.misses;
+        loaded_at[v] = stats.misses;
+      }
+    }
+    return stats;
+  }
+  
+  static void optimize_triangle_order(std::vector<uint32_t>& triangles, std::vector<int32_t>& face_material,
+                                      size_t num_vertices, unsigned cache_size){
+    const size_t num_triangles = triangles.size()/3;
+    if(num_triangles == 0)
+      return;
+    const std::vector<uint32_t>& index = triangles;
+    
+    // vertex -> triangles, compressed
+    std::vector<uint32_t> live(num_vertices, 0);
+    for(uint32_t v : index)
+      ++live[v];
+    std::vector<uint32_t> offsets(num_vertices + 1, 0);
+    for(size_t v = 0; v < num_vertices; ++v)
+      offsets[v+1] = offsets[v] + live[v];
+    std::vector<uint32_t> adjacency(index.size());
+    {
+      std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+      for(size_t i = 0; i < index.size(); ++i)
+        adjacency[fill[index[i]]++] = (uint32_t)(i/3);
+    }
+    
+    std::vector<int64_t> cache_time(num_vertices, 0);
+    std::vector<bool> emitted(num_triangles, false);
+    std::vector<uint32_t> dead_end;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> order;
+    order.reserve(num_triangles);
+    
+    const int64_t k = cache_size;
+    int64_t stamp = k + 1;
+    size_t cursor = 0;
+    int64_t fanning = 0;
+    
+    while(fanning >= 0){
+      candidates.clear();
+      for(uint32_t a = offsets[fanning]; a < offsets[fanning+1]; ++a){
+        uint32_t t = adjacency[a];
+        if(emitted[t])
+          continue;
+        emitted[t] = true;
+        order.push_back(t);
+        for(int c = 0; c < 3; ++c){
+          uint32_t v = index[t*3 + c];
+          dead_end.push_back(v);
+          candidates.push_back(v);
+          --live[v];
+          if(stamp - cache_time[v] > k)
+            cache_time[v] = stamp++;
+        }
+      }
+      
+      // next fanning vertex: the candidate still in cache that keeps the most of its fan in cache
+      fanning = -1;
+      int64_t best = -1;
+      for(uint32_t v : candidates){
+        if(live[v] == 0)
+          continue;
+        int64_t priority = 0;
+        if(stamp - cache_time[v] + 2*(int64_t)live[v] <= k)
+          priority = stamp - cache_time[v];
+        if(priority > best){
+          best = priority;
+          fanning = v;
+        }
+      }
+      
+      // dead end, fall back to recently used vertices, then to input order
+      while(fanning < 0 && !dead_end.empty()){
+        uint32_t v = dead_end.back();
+        dead_end.pop_back();
+        if(live[v] > 0)
+          fanning = v;
+      }
+      while(fanning < 0 && cursor < num_vertices){
+        if(live[cursor] > 0)
+          fanning = (int64_t)cursor;
+        ++cursor;
+      }
+    }
+    
+    std::vector<uint32_t> new_index(index.size());
+    for(size_t i = 0; i < order.size(); ++i){
+      new_index[i*3 + 0] = index[order[i]*3 + 0];
+      new_index[i*3 + 1] = index[order[i]*3 + 1];
+      new_index[i*3 + 2] = index[order[i]*3 + 2];
+    }
+    if(face_material.size() == num_triangles){
+      std::vector<int32_t> new_face_material(num_triangles);
+      for(size_t i = 0; i < order.size(); ++i)
+        new_face_material[i] = face_material[order[i]];
+      face_material = std::move(new_face_material);
+    }
+    triangles = std::move(new_index);
+  }
+  
+  // reorders every run of triangles sharing a face material on its own, over the vertices the run uses
+  static void optimize_material_runs(std::vector<uint32_t>& index, std::vector<int32_t>& face_material,
+                                     size_t num_vertices, unsigned cache_size){
+    const size_t num_triangles = index.size()/3;
+    if(face_material.size() != num_triangles){
+      optimize_triangle_order(index, face_material, num_vertices, cache_size);
+      return;
+    }
+    const uint32_t unused = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> local(num_vertices, unused);
+    std::vector<uint32_t> vertices;
+    std::vector<uint32_t> run;
+    std::vector<int32_t> run_material;
+    for(size_t begin = 0, end = 0; begin < num_triangles; begin = end){
+      while(end < num_triangles && face_material[end] == face_material[begin])
+        ++end;
+      vertices.clear();
+      run.clear();
+      for(size_t i = begin*3; i < end*3; ++i){
+        uint32_t v = index[i];
+        if(local[v] == unused){
+          local[v] = (uint32_t)vertices.size();
+          vertices.push_back(v);
+        }
+        run.push_back(local[v]);
+      }
+      optimize_triangle_order(run, run_material, vertices.size(), cache_size);
+      for(size_t i = 0; i < run.size(); ++i)
+        index[begin*3 + i] = vertices[run[i]];
+      for(uint32_t v : vertices)
+        local[v] = unused;
+    }
+  }
+  
+  void optimize_vertex_cache(MeshSource* mesh, unsigned cache_size){
+    const size_t num_vertices = mesh->pos.size()/3;
+    optimize_material_runs(mesh->index, mesh->face_material_idx, num_vertices, cache_size);
+    for(MeshLod& lod : mesh->lods)
+      optimize_material_runs(lod.index, lod.face_material_idx, num_vertices, cache_size);
+  }
+  
+  void optimize_vertex_fetch(MeshSource* mesh){
+    const size_t num_vertices = mesh->pos.size()/3;
+    const uint32_t unused = std::numeric_limits<uint32_t>::max();
+    bool has_normal = mesh->normal.size() == mesh->pos.size();
+    bool has_uv = mesh->uv.size() == num_vertices*2;
+    
+    std::vector<uint32_t> remap(num_vertices, unused);
+    std::vector<float> pos;
+    std::vector<float> normal;
+    std::vector<float> uv;
+    pos.reserve(mesh->pos.size());
+    normal.reserve(has_normal ? mesh->normal.size() : 0);
+    uv.reserve(has_uv ? mesh->uv.size() : 0);
+    
+    uint32_t next = 0;
+    for(uint32_t& v : mesh->index){
+      if(remap[v] == unused){
+        remap[v] = next++;
+        pos.insert(pos.end(), &mesh->pos[v*3], &mesh->pos[v*3] + 3);
+        if(has_normal)
+          normal.insert(normal.end(), &mesh->normal[v*3], &mesh->normal[v*3] + 3);
+        if(has_uv)
+          uv.insert(uv.end(), &mesh->uv[v*2], &mesh->uv[v*2] + 2);
+      }
+      v = remap[v];
+    }
+    // levels of detail only reference vertices of the full mesh
+    for(MeshLod& lod : mesh->lods){
+      for(uint32_t& v : lod.index)
+        v = remap[v];
+    }
+    
+    mesh->pos = std::move(pos);
+    if(has_normal)
+      mesh->normal = std::move(normal);
+    if(has_uv)
+      mesh->uv = std::move(uv);
+  }
+}
@@ -0,0 +1,88 @@
+//
+//  MeshProcess.hpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#ifndef MeshProcess_hpp
+#define MeshProcess_hpp
+
+#include "MeshImport.h"
+
+namespace trisetra {
+  
+  // attributes closer than these (per component) are considered equal when welding
+  struct WeldOptions{
+    float position_eps = 1.0e-5f;
+    float normal_eps = 1.0e-3f;
+    float uv_eps = 1.0e-5f;
+  };
+  
+  // merges vertices with matching position, normal and uv through a spatial hash and remaps
+  // mesh->index and every level of detail accordingly. triangles collapsing to a line are dropped along with their
+  // face_material_idx entry. returns the number of vertices removed.
+  size_t weld_vertices(MeshSource* mesh, const WeldOptions& options);
+  
+  struct LodOptions{
+    // upper bound of levels, each halves the triangles at the default ratio so more never pay off
+    static const unsigned max_levels = 16;
+    // levels below the full resolution mesh, at most max_levels
+    unsigned levels = 3;
+    // target triangle count of each level relative to the previous one
+    float ratio = 0.5f;
+    // bound on the error of the coarsest level, relative to the mesh bounds diagonal
+    float max_error = 0.01f;
+  };
+  
+  // quadric error edge collapse (Garland and Heckbert 1997) where a position only collapses onto a
+  // neighbour, so every level indexes the vertices of the full mesh. all copies of a position move
+  // together: normal splits are dropped, uv and material seams only slide along themselves, as do
+  // open borders. positions on non manifold edges or where three seams meet are locked.
+  // each level simplifies the previous one, the chain stops early once a level barely reduces.
+  // fills mesh->lods and returns the number of levels, never more than LodOptions::max_levels.
+  size_t generate_lods(MeshSource* mesh, const LodOptions& options);
+  
+  // stable LSD radix sort, 8 bits per pass and only as many passes as the largest key needs.
+  // histograms and scatter of every pass run over blocks in parallel. returns the sorted order of keys
+  std::vector<uint32_t> radix_sort(const std::vector<uint32_t>& keys);
+  // runs of equal keys, one key per triangle
+  std::vector<DrawRange> draw_ranges(const std::vector<uint32_t>& triangle_keys);
+  // sorts the triangles of the mesh and of each level of detail by face material. the sort is
+  // stable, run it before optimize_vertex_cache which then keeps the material runs
+  void sort_by_material(MeshSource* mesh);
+  
+  // a run of triangles referencing at most 65536 vertices, addressable with 16 bit indices
+  struct IndexChunk{
+    std::vector<uint32_t> vertices;  // source vertex of every chunk vertex
+    std::vector<uint16_t> indices;   // into vertices
+  };
+  
+  // splits a triangle list over vertex_count vertices into consecutive 16 bit chunks,
+  // keeping triangle order. vertices shared across a chunk border are duplicated.
+  std::vector<IndexChunk> split_index16(const std::vector<uint32_t>& indices, size_t vertex_count);
+  
+  // post transform cache efficiency of a triangle list, simulated with a FIFO cache.
+  // acmr = transformed vertices per triangle, atvr = transformed vertices per referenced vertex
+  struct VertexCacheStats{
+    size_t triangles = 0;
+    size_t vertices = 0;
+    size_t misses = 0;
+    float acmr() const { return triangles ? (float)misses/triangles : 0.0f; }
+    float atvr() const { return vertices ? (float)misses/vertices : 0.0f; }
+  };
+  VertexCacheStats measure_vertex_cache(const std::vector<uint32_t>& indices, size_t vertex_count, unsigned cache_size);
+  
+  // reorders triangles for post transform cache locality (tipsify, Sander et al. 2007) within each
+  // run of equal face material, so material ranges survive. levels of detail are reordered independently
+  void optimize_vertex_cache(MeshSource* mesh, unsigned cache_size);
+  // renumbers vertices in order of first use so fetches walk memory linearly, unreferenced vertices are dropped
+  void optimize_vertex_fetch(MeshSource* mesh);
+  
+  // IEEE 754 half float, round to nearest even
+  uint16_t float_to_half(float value);
+  // octahedral mapping of a unit normal to two unorm values of the given bit width
+  void encode_octahedral(const float* normal, int bits, uint32_t* out);
+}
+
+#endif /* MeshProcess_hpp */
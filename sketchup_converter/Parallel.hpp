@@ -0,0 +1,145 @@
+//
+//  Parallel.hpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#ifndef Parallel_hpp
+#define Parallel_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace trisetra {
+  
+  // cap on worker_count() for the calling thread, 0 for none. threads started by parallel_for and
+  // TaskPool inherit it, so nested parallel work stays within the share of the caller
+  inline unsigned& thread_budget(){
+    thread_local unsigned budget = 0;
+    return budget;
+  }
+  
+  // sets thread_budget() for the lifetime of the scope
+  struct ThreadBudgetScope{
+    explicit ThreadBudgetScope(unsigned budget) : previous(thread_budget()){ thread_budget() = budget; }
+    ~ThreadBudgetScope(){ thread_budget() = previous; }
+    unsigned previous;
+  };
+  
+  inline unsigned worker_count(){
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    return thread_budget() ? std::min(thread_budget(), cores) : cores;
+  }
+  
+  // calls fn(i) for i in [0, count) across all cores, or at most max_threads. work is handed out
+  // in chunks of grain from a shared counter so uneven items balance out. fn must not throw.
+  template<typename Fn>
+  void parallel_for(size_t count, Fn&& fn, size_t grain = 1, unsigned max_threads = 0){
+    grain = std::max<size_t>(grain, 1);
+    size_t num_threads = std::min<size_t>(max_threads ? max_threads : worker_count(), (count + grain - 1)/grain);
+    if(num_threads <= 1){
+      for(size_t i = 0; i < count; ++i)
+        fn(i);
+      return;
+    }
+    
+    std::atomic<size_t> next(0);
+    unsigned budget = thread_budget();
+    auto worker = [&](){
+      thread_budget() = budget;
+      while(true){
+        size_t begin = next.fetch_add(grain);
+        if(begin >= count)
+          break;
+        size_t end = std::min(count, begin + grain);
+        for(size_t i = begin; i < end; ++i)
+          fn(i);
+      }
+    };
+    
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for(size_t t = 1; t < num_threads; ++t)
+      threads.emplace_back(worker);
+    worker();
+    for(auto& thread : threads)
+      thread.join();
+  }
+  
+  // runs submitted tasks on up to max_threads background threads, started as tasks arrive, so the
+  // submitter keeps working meanwhile. tasks are started in submission order but with more than one
+  // thread finish in any order, and must not throw. the destructor waits for every task
+  class TaskPool{
+  public:
+    explicit TaskPool(unsigned max_threads = 0)
+    : _max_threads(max_threads ? max_threads : worker_count()), _budget(thread_budget()){}
+    ~TaskPool(){
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+      }
+      _task_ready.notify_all();
+      for(auto& thread : _threads)
+        thread.join();
+    }
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+    
+    void submit(std::function<void()> task){
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tasks.push_back(std::move(task));
+        ++_pending;
+        if(_idle == 0 && _threads.size() < _max_threads)
+          _threads.emplace_back([this](){ run(); });
+      }
+      _task_ready.notify_one();
+    }
+    
+    // blocks until every task submitted so far has finished
+    void wait(){
+      std::unique_lock<std::mutex> lock(_mutex);
+      _all_done.wait(lock, [this](){ return _pending == 0; });
+    }
+    
+  protected:
+    void run(){
+      thread_budget() = _budget;
+      std::unique_lock<std::mutex> lock(_mutex);
+      while(true){
+        ++_idle;
+        _task_ready.wait(lock, [this](){ return _stopping || !_tasks.empty(); });
+        --_idle;
+        if(_tasks.empty())
+          return;
+        std::function<void()> task = std::move(_tasks.front());
+        _tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        if(--_pending == 0)
+          _all_done.notify_all();
+      }
+    }
+    
+    unsigned                          _max_threads;
+    unsigned                          _budget;
+    std::vector<std::thread>          _threads;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex                        _mutex;
+    std::condition_variable           _task_ready;
+    std::condition_variable           _all_done;
+    size_t                            _pending = 0;
+    unsigned                          _idle = 0;
+    bool                              _stopping = false;
+  };
+}
+
+#endif /* Parallel_hpp */
@@ -0,0 +1,317 @@
+//
+//  WorkerProcess.cpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#include "WorkerProcess.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace trisetra {
+
+  const uint32_t WorkerReply::max_counters;
+
+  ////////////// SharedMemory //////////////
+
+  SharedMemory SharedMemory::create(const std::string& name, size_t size){
+    int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0)
+      throw std::runtime_error("SharedMemory failed to create " + name + ": " + std::strerror(errno));
+    // an empty mapping is not allowed, every object carries at least one byte
+    size_t mapped = std::max<size_t>(size, 1);
+    if(::ftruncate(fd, (off_t)mapped) != 0){
+      int error = errno;
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      throw std::runtime_error("SharedMemory failed to size " + name + ": " + std::strerror(error));
+    }
+    void* data = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED){
+      ::shm_unlink(name.c_str());
+      throw std::runtime_error("SharedMemory failed to map " + name);
+    }
+    SharedMemory shm;
+    shm._data = (char*)data;
+    shm._size = mapped;
+    return shm;
+  }
+
+  SharedMemory SharedMemory::open(const std::string& name){
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if(fd < 0)
+      throw std::runtime_error("SharedMemory failed to open " + name + ": " + std::strerror(errno));
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || st.st_size == 0){
+      ::close(fd);
+      throw std::runtime_error("SharedMemory empty or unreadable: " + name);
+    }
+    void* data = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED)
+      throw std::runtime_error("SharedMemory failed to map " + name);
+    SharedMemory shm;
+    shm._data = (char*)data;
+    shm._size = (size_t)st.st_size;
+    return shm;
+  }
+
+  void SharedMemory::unlink(const std::string& name){
+    ::shm_unlink(name.c_str());
+  }
+
+  SharedMemory::SharedMemory(SharedMemory&& other) : _data(other._data), _size(other._size){
+    other._data = nullptr;
+    other._size = 0;
+  }
+
+  SharedMemory::~SharedMemory(){
+    if(_data)
+      ::munmap(_data, _size);
+  }
+
+  std::string unique_shm_name(){
+    static std::atomic<uint32_t> counter(0);
+    // macOS limits names to 31 characters
+    return "/tsc." + std::to_string(::getpid()) + "." + std::to_string(counter++);
+  }
+
+  ////////////// pipe and socket messages //////////////
+
+  bool read_all(int fd, void* dst, size_t size){
+    char* bytes = (char*)dst;
+    while(size > 0){
+      ssize_t n = ::read(fd, bytes, size);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      bytes += n;
+      size -= (size_t)n;
+    }
+    return true;
+  }
+
+  bool write_all(int fd, const void* src, size_t size){
+    const char* bytes = (const char*)src;
+    while(size > 0){
+      ssize_t n = ::write(fd, bytes, size);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      bytes += n;
+      size -= (size_t)n;
+    }
+    return true;
+  }
+
+  bool write_string(int fd, const std::string& value){
+    uint32_t length = (uint32_t)value.size();
+    return write_all(fd, &length, sizeof(length)) && write_all(fd, value.data(), value.size());
+  }
+
+  bool read_string(int fd, std::string& value){
+    uint32_t length = 0;
+    if(!read_all(fd, &length, sizeof(length)))
+      return false;
+    value.resize(length);
+    return read_all(fd, &value[0], length);
+  }
+
+  // uint32 count + uint64 values, a count over WorkerReply::max_counters means a broken stream
+  static bool read_counters(int fd, std::vector<uint64_t>& counters){
+    uint32_t count = 0;
+    if(!read_all(fd, &count, sizeof(count)) || count > WorkerReply::max_counters)
+      return false;
+    counters.resize(count);
+    return read_all(fd, counters.data(), count*sizeof(uint64_t));
+  }
+
+  ////////////// WorkerProcess //////////////
+
+  // pipe creation and fork are serialized, so a worker spawned by another thread never inherits
+  // descriptors before they are marked close on exec
+  static std::mutex spawn_mutex;
+
+  // an idle worker exits as soon as its pipe closes, this only bounds one that does not
+  static const unsigned stop_grace_seconds = 5;
+
+  typedef std::chrono::steady_clock::time_point Deadline;
+
+  // false once deadline passes without fd becoming readable, end of file counts as readable
+  static bool wait_readable(int fd, Deadline deadline){
+    for(;;){
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if(left <= 0)
+        return false;
+      pollfd entry = {fd, POLLIN, 0};
+      int ready = ::poll(&entry, 1, (int)std::min<long long>(left, INT_MAX));
+      if(ready > 0)
+        return true;
+      if(ready < 0 && errno != EINTR)
+        return true;  // let the read report it
+    }
+  }
+
+  WorkerProcess::WorkerProcess(const std::string& executable, const std::vector<std::string>& arguments, unsigned timeout_seconds)
+  : _executable(executable), _arguments(arguments), _timeout_seconds(timeout_seconds){
+    spawn();
+  }
+
+  WorkerProcess::~WorkerProcess(){
+    stop();
+  }
+
+  void WorkerProcess::spawn(){
+    std::lock_guard<std::mutex> lock(spawn_mutex);
+    // a dead worker must surface as a failed write, not take the supervisor down
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int to_worker[2];
+    int from_worker[2];
+    if(::pipe(to_worker) != 0)
+      throw std::runtime_error("WorkerProcess failed to create pipe");
+    if(::pipe(from_worker) != 0){
+      ::close(to_worker[0]);
+      ::close(to_worker[1]);
+      throw std::runtime_error("WorkerProcess failed to create pipe");
+    }
+    for(int fd : {to_worker[0], to_worker[1], from_worker[0], from_worker[1]})
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // everything the child needs is built before fork, it only makes async signal safe calls
+    std::string in_fd = std::to_string(to_worker[0]);
+    std::string out_fd = std::to_string(from_worker[1]);
+    std::vector<char*> argv = {(char*)_executable.c_str(), (char*)"--worker", (char*)in_fd.c_str(), (char*)out_fd.c_str()};
+    for(const std::string& argument : _arguments)
+      argv.push_back((char*)argument.c_str());
+    argv.push_back(nullptr);
+
+    pid_t pid = ::fork();
+    if(pid == 0){
+      ::fcntl(to_worker[0], F_SETFD, 0);
+      ::fcntl(from_worker[1], F_SETFD, 0);
+      ::execvp(argv[0], argv.data());
+      ::_exit(127);
+    }
+    ::close(to_worker[0]);
+    ::close(from_worker[1]);
+    if(pid < 0){
+      ::close(to_worker[1]);
+      ::close(from_worker[0]);
+      throw std::runtime_error("WorkerProcess failed to fork");
+    }
+    _pid = pid;
+    _to_worker = to_worker[1];
+    _from_worker = from_worker[0];
+  }
+
+  void WorkerProcess::stop(){
+    if(_to_worker >= 0)
+      ::close(_to_worker);
+    if(_from_worker >= 0)
+      ::close(_from_worker);
+    _to_worker = -1;
+    _from_worker = -1;
+    // the worker exits on end of file, or is already gone
+    if(_pid > 0)
+      reap(stop_grace_seconds);
+    _pid = -1;
+  }
+
+  int WorkerProcess::reap(unsigned grace_seconds){
+    int status = 0;
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::seconds(grace_seconds);
+    for(;;){
+      pid_t done = ::waitpid(_pid, &status, WNOHANG);
+      if(done == _pid || (done < 0 && errno != EINTR))
+        return status;
+      if(done == 0 && std::chrono::steady_clock::now() >= deadline)
+        break;
+      if(done == 0)
+        ::usleep(10000);
+    }
+    ::kill(_pid, SIGKILL);
+    while(::waitpid(_pid, &status, 0) < 0 && errno == EINTR){}
+    return status;
+  }
+
+  void WorkerProcess::restart(){
+    stop();
+    spawn();
+  }
+
+  bool WorkerProcess::run(const std::string& job, const std::string& shm_name, WorkerReply& reply){
+    uint32_t ok = 0;
+    bool timed_out = false;
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::seconds(_timeout_seconds);
+    // the reply is written in one go once the job is done, so only its start is waited for
+    auto replied = [&](){
+      timed_out = _timeout_seconds > 0 && !wait_readable(_from_worker, deadline);
+      return !timed_out;
+    };
+    bool answered = _pid > 0 &&
+                    write_string(_to_worker, job) &&
+                    write_string(_to_worker, shm_name) &&
+                    replied() &&
+                    read_all(_from_worker, &ok, sizeof(ok)) &&
+                    read_all(_from_worker, &reply.size, sizeof(reply.size)) &&
+                    read_string(_from_worker, reply.error) &&
+                    read_counters(_from_worker, reply.counters);
+    if(answered){
+      reply.ok = ok != 0;
+      return true;
+    }
+
+    _crash_reason = "worker did not answer";
+    if(_pid > 0){
+      ::close(_to_worker);
+      ::close(_from_worker);
+      _to_worker = -1;
+      _from_worker = -1;
+      int status = reap(timed_out ? 0 : stop_grace_seconds);
+      if(timed_out)
+        _crash_reason = "worker timed out after " + std::to_string(_timeout_seconds) + "s and was killed";
+      else if(WIFSIGNALED(status))
+        _crash_reason = "worker killed by signal " + std::to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+      else if(WIFEXITED(status))
+        _crash_reason = "worker exited with status " + std::to_string(WEXITSTATUS(status));
+      _pid = -1;
+    }
+    return false;
+  }
+
+  int serve_worker(int in_fd, int out_fd, const WorkerHandler& handler){
+    std::string job;
+    std::string shm_name;
+    while(read_string(in_fd, job) && read_string(in_fd, shm_name)){
+      WorkerReply reply = handler(job, shm_name);
+      uint32_t ok = reply.ok ? 1 : 0;
+      uint32_t counter_count = (uint32_t)std::min<size_t>(reply.counters.size(), WorkerReply::max_counters);
+      if(!write_all(out_fd, &ok, sizeof(ok)) ||
+         !write_all(out_fd, &reply.size, sizeof(reply.size)) ||
+         !write_string(out_fd, reply.error) ||
+         !write_all(out_fd, &counter_count, sizeof(counter_count)) ||
+         !write_all(out_fd, reply.counters.data(), counter_count*sizeof(uint64_t)))
+        return 1;
+    }
+    return 0;
+  }
+}
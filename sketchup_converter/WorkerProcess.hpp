@@ -0,0 +1,102 @@
+//
+//  WorkerProcess.hpp
+//  sketchup_converter
+//
+//  Copyright © 2018 trisetra. All rights reserved.
+//
+
+#ifndef WorkerProcess_hpp
+#define WorkerProcess_hpp
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace trisetra {
+
+  // blocking message helpers for pipes and sockets, false once the other end is gone
+  bool read_all(int fd, void* dst, size_t size);
+  bool write_all(int fd, const void* src, size_t size);
+  // uint32 length + bytes
+  bool read_string(int fd, std::string& value);
+  bool write_string(int fd, const std::string& value);
+
+  // named POSIX shared memory object mapped into this process. the creator maps it read/write,
+  // openers read only. the name stays valid until unlink, the mapping until destruction
+  class SharedMemory{
+  public:
+    static SharedMemory create(const std::string& name, size_t size);
+    static SharedMemory open(const std::string& name);
+    // removes the name, ignoring names that do not exist
+    static void unlink(const std::string& name);
+
+    SharedMemory(SharedMemory&& other);
+    ~SharedMemory();
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+  protected:
+    SharedMemory() = default;
+
+    char*  _data = nullptr;
+    size_t _size = 0;
+  };
+
+  // answer of a worker to one job, the payload is left in the shared memory object named by the job
+  struct WorkerReply{
+    bool                  ok = false;
+    uint64_t              size = 0;
+    std::string           error;
+    // statistics of the job for the supervisor to report, at most max_counters
+    std::vector<uint64_t> counters;
+    static const uint32_t max_counters = 64;
+  };
+
+  // child process started as `<executable> --worker <in fd> <out fd> [arguments]`, serving jobs one at a time.
+  // jobs and replies travel over a pair of pipes, payloads through shared memory, so a worker that
+  // crashes takes nothing but its current job down with it. one that hangs is killed once a job
+  // exceeds timeout_seconds (0 waits forever)
+  class WorkerProcess{
+  public:
+    explicit WorkerProcess(const std::string& executable, const std::vector<std::string>& arguments = {},
+                           unsigned timeout_seconds = 0);
+    ~WorkerProcess();
+    WorkerProcess(const WorkerProcess&) = delete;
+    WorkerProcess& operator=(const WorkerProcess&) = delete;
+
+    // hands job to the worker and waits for its reply. returns false if the worker died or timed out
+    // first, crash_reason() then says how and restart() brings up a fresh one
+    bool run(const std::string& job, const std::string& shm_name, WorkerReply& reply);
+    void restart();
+    const std::string& crash_reason() const { return _crash_reason; }
+
+  protected:
+    void spawn();
+    void stop();
+    // waits for the worker to exit, killing it after grace_seconds, and returns its wait status
+    int reap(unsigned grace_seconds);
+
+    std::string _executable;
+    std::vector<std::string> _arguments;
+    unsigned    _timeout_seconds;
+    pid_t       _pid = -1;
+    int         _to_worker = -1;
+    int         _from_worker = -1;
+    std::string _crash_reason;
+  };
+
+  typedef std::function<WorkerReply(const std::string& job, const std::string& shm_name)> WorkerHandler;
+
+  // worker side: answers jobs with handler until the supervisor closes the pipe. handler must not throw
+  int serve_worker(int in_fd, int out_fd, const WorkerHandler& handler);
+
+  // shared memory name unique to this process
+  std::string unique_shm_name();
+}
+
+#endif /* WorkerProcess_hpp */
@@ -33,9 +33,36 @@
 #include <SketchUpAPI/unicodestring.h>
 #include <Eigen/Dense>
 #include "MeshImporter.hpp"
+#include "ConversionCache.hpp"
+#include "ConvertService.hpp"
+#include "DefinitionStore.hpp"
+#include "Parallel.hpp"
+#include "WorkerProcess.hpp"
+#include <array>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #define SU_CALL(func)          \
 if ((func) != SU_ERROR_NONE) \
 throw std::exception()
@@ -83,13 +110,59 @@ using namespace trisetra;
     return name.utf8();
   }
   
+  // per face SketchUp API output, reused across WriteFace calls of one load. WriteMeshSource sizes it
+  // and the destination buffers from its tessellation pass, so extracting faces never allocates
+  struct SUFaceScratch {
+    std::vector<SUPoint3D>  vertices;
+    std::vector<SUVector3D> normals;
+    std::vector<SUPoint3D>  stq_coords;
+    std::vector<size_t>     indices;
+  };
+  
+  // a face tessellated by the first pass of WriteMeshSource, extracted by the second
+  struct SUTessellatedFace {
+    SUMeshHelperRef mesh_ref = SU_INVALID;
+    size_t          num_vertices = 0;
+    size_t          num_triangles = 0;
+    int32_t         local_mat_id = 0;   // into the mesh palette
+    bool            back = false;       // extract the back face uvs with reversed winding
+    float           inv_ss = 1.0f;
+    float           inv_tt = 1.0f;
+  };
+  
+  // releases the helpers WriteFace did not get to, if a face throws part way through a mesh
+  struct SUTessellation {
+    std::vector<SUTessellatedFace> faces;
+    ~SUTessellation() {
+      for (SUTessellatedFace& face : faces) {
+        if (SUIsValid(face.mesh_ref))
+          SUMeshHelperRelease(&face.mesh_ref);
+      }
+    }
+  };
+  
   struct SUImportInfo {
     std::vector<SUMaterialRef>                  mats;
+    std::unordered_map<void*, long>             mat_index;  // SUMaterialRef.ptr -> index into mats
     std::vector<std::string>                    names;
     std::vector<SUImageRepRef>                     textures;
     std::vector<SUPoint2D>                      texST;
-    std::map<void*, MeshSource*>      def_map;
+    // (definition, inherited material) -> local geometry, faces without a material take the inherited one
+    std::map<std::pair<void*, void*>, MeshSource*> def_map;
     std::map<void*, std::vector<SUMaterialRef>> mat_map;
+    // component definitions served from def_map vs. extracted through the API
+    size_t                                      def_cache_hits = 0;
+    size_t                                      def_cache_misses = 0;
+    // mirrored variants of def_map entries, keyed by (def_map key, quantized bake matrix)
+    std::map<std::pair<std::pair<void*, void*>, std::array<int32_t, 9>>, MeshSource*> mirror_map;
+    size_t                                      mirror_cache_hits = 0;
+    size_t                                      mirror_cache_misses = 0;
+    SUFaceScratch                               scratch;
+    // definition geometry kept between runs, null when not in use
+    DefinitionStore*                            definition_store = nullptr;
+    std::unordered_map<std::string, int>        material_by_name;  // MaterialData::name -> material index
+    size_t                                      definitions_reused = 0;
+    size_t                                      definitions_extracted = 0;
   };
   
   struct SUPolyInfo {
@@ -98,6 +171,7 @@ using namespace trisetra;
     std::vector<float>    vertex_normals;  // The vertex's surface normal (x,y,z)
     std::vector<float>    uvs;             // The vertex's texture coordinates (u,v)
     std::vector<int32_t>  material_ids;
+    std::vector<int32_t>  material_remap;  // global material idx -> idx into material_ids, -1 if unused
     std::vector<int32_t>  face_material;
   };
   
@@ -160,18 +234,112 @@ using namespace trisetra;
     if (use_opacity)
       material->opacity = opt;
   }
-  static void AddTextrueToMat(SUImageRepRef&                         img_rep,
-                              std::shared_ptr<MaterialData>& material,
-                              const std::string&                     composed_name) {
-    if (SUIsValid(img_rep)) {
-      size_t width, height, data_size, bits_per_pixel;
+  
+  // writes the texture maps of a model, one file per distinct image. images are told apart by a hash of
+  // their pixels, so materials sharing an image share its file, and encoded on a TaskPool while the
+  // geometry is traversed. each task owns its image rep, which is detached from the model
+  // files land in directory, base_color_map names them relative to it as "./<texture name>_<hash>.png"
+  struct TextureExport {
+    struct Written {
+      std::string                                 map;   // base_color_map of the materials
+      std::string                                 path;  // where the file is written
+      std::vector<std::shared_ptr<MaterialData>>  materials;
+      bool                                        ok = false;
+    };
+    
+    explicit TextureExport(const std::string& directory) : directory(directory) {}
+    
+    std::string                                   directory;
+    std::unordered_map<uint64_t, size_t>          by_pixels;  // pixel hash -> index into written
+    std::deque<Written>                           written;    // stable addresses for the tasks
+    std::vector<SUByte>                           pixels;
+    size_t                                        shared = 0;
+    // last, so it is destroyed first and its tasks finish before written goes away
+    TaskPool                                      pool;
+    
+    // takes ownership of img_rep and points material at its file.
+    // the pixels are copied out and img_rep released here, the pool threads only see owned buffers
+    // and never call into the SketchUp API
+    void add(SUImageRepRef img_rep, const std::string& tex_name, const std::shared_ptr<MaterialData>& material) {
+      size_t width = 0, height = 0, data_size = 0, bits_per_pixel = 0, row_padding = 0;
+      SUImageRepConvertTo32BitsPerPixel(img_rep);
       SUImageRepGetPixelDimensions(img_rep, &width, &height);
       SUImageRepGetDataSize(img_rep, &data_size, &bits_per_pixel);
-      std::string file_path = "./" +composed_name+".png";
-      SUImageRepSaveToFile(img_rep, file_path.c_str());
-      material->base_color_map = file_path;
+      SUImageRepGetRowPadding(img_rep, &row_padding);
+      pixels.resize(data_size);
+      if (data_size > 0)
+        SUImageRepGetData(img_rep, data_size, pixels.data());
+      SUImageRepRelease(&img_rep);
+      size_t stride = width * 4 + row_padding;
+      bool readable = bits_per_pixel == 32 && width > 0 && height > 0 && stride * height <= pixels.size();
+      // the row padding holds arbitrary bytes, only the pixels of each row tell images apart
+      uint64_t layout[3] = {width, height, bits_per_pixel};
+      uint64_t key = hash64(layout, sizeof(layout));
+      if (readable) {
+        for (size_t y = 0; y < height; ++y)
+          key = hash64(pixels.data() + y * stride, width * 4, key);
+      } else {
+        key = hash64(pixels.data(), pixels.size(), key);
+      }
+      
+      auto found = by_pixels.find(key);
+      if (found != by_pixels.end()) {
+        Written& file = written[found->second];
+        material->base_color_map = file.map;
+        file.materials.push_back(material);
+        ++shared;
+        return;
+      }
+      
+      char hex[17];
+      std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+      by_pixels[key] = written.size();
+      written.emplace_back();
+      Written* file = &written.back();
+      file->map = "./" + tex_name + "_" + hex + ".png";
+      file->path = directory + file->map.substr(1);
+      file->materials.push_back(material);
+      material->base_color_map = file->map;
+      
+      if (!readable)
+        return;  // left !ok, finish() drops the map
+      SUColorOrder order = SUGetColorOrder();
+      std::shared_ptr<std::vector<SUByte>> data = std::make_shared<std::vector<SUByte>>(std::move(pixels));
+      pool.submit([file, data, width, height, stride, order]() {
+        // image rep rows start at the bottom, png rows at the top
+        std::vector<uint8_t> rgba(width * height * 4);
+        for (size_t y = 0; y < height; ++y) {
+          const SUByte* src = data->data() + (height - 1 - y) * stride;
+          uint8_t* dst = &rgba[y * width * 4];
+          for (size_t x = 0; x < width; ++x, src += 4, dst += 4) {
+            dst[0] = src[order.red_index];
+            dst[1] = src[order.green_index];
+            dst[2] = src[order.blue_index];
+            dst[3] = src[order.alpha_index];
+          }
+        }
+        // renamed into place, a concurrent conversion sharing the image never sees a partial file
+        std::string temp = file->path + ".tmp." + std::to_string(::getpid()) + ".png";
+        file->ok = write_png(temp, (uint32_t)width, (uint32_t)height, rgba.data()) &&
+                   ::rename(temp.c_str(), file->path.c_str()) == 0;
+        if (!file->ok)
+          ::unlink(temp.c_str());
+      });
     }
-  }
+    
+    // waits for the encoding, materials whose map failed to write keep their base color only
+    void finish() {
+      pool.wait();
+      for (Written& file : written) {
+        if (file.ok)
+          continue;
+        std::cerr << "failed to write texture " << file.path << std::endl;
+        for (auto& material : file.materials)
+          material->base_color_map.clear();
+      }
+      std::cout << "textures written:" << written.size() << " shared:" << shared << std::endl;
+    }
+  };
   
   // returns first the transform to store for the node3d
   // the second transform (might cointains negtive scale) to be baked into vertecies
@@ -204,20 +372,17 @@ using namespace trisetra;
     }
   }
   
-  static void WriteFace(SUFaceRef              face,
-                        SUTextureWriterRef     texture_writer,
-                        SUPolyInfo&            m_data,
-                        SUImportInfo&          mat_info,
-                        int                    parent_idx,
-                        bool                   front,
-                        SUMaterialRef          assigned,
-                        bool                   instanced,
-                        MeshImport*  mesh_import,
-                        MeshSource*  mesh,
-                        const Eigen::Affine3f& transform,
-                        const Eigen::Matrix3f& normal_transform) {
+  // resolves the material of face and tessellates it, the helper stays alive for WriteFace
+  static SUTessellatedFace TessellateFace(SUFaceRef          face,
+                                          SUTextureWriterRef texture_writer,
+                                          SUPolyInfo&        m_data,
+                                          SUImportInfo&      mat_info,
+                                          SUMaterialRef      assigned,
+                                          MeshImport*        mesh_import,
+                                          MeshSource*        mesh) {
+    SUTessellatedFace tessellated;
     if (SUIsInvalid(face))
-      return;
+      return tessellated;
     
     SUMaterialRef face_material = SU_INVALID;
     
@@ -256,10 +421,9 @@ using namespace trisetra;
     
     long mat_idx = 0;
     
-    auto find_mat_it = std::find_if(
-                                    mat_info.mats.begin(), mat_info.mats.end(), [face_material](const SUMaterialRef& in) { return face_material.ptr == in.ptr; });
-    if (find_mat_it != mat_info.mats.end()) {
-      mat_idx = find_mat_it - mat_info.mats.begin();
+    auto find_mat_it = mat_info.mat_index.find(face_material.ptr);
+    if (find_mat_it != mat_info.mat_index.end()) {
+      mat_idx = find_mat_it->second;
     }
     
     bool has_texture = SUIsValid(mat_info.textures[mat_idx]);  // info.has_front_texture_ || info.has_back_texture_;
@@ -269,69 +433,83 @@ using namespace trisetra;
       SUTextureWriterGetTextureIdForFace(texture_writer, face, true, &textureId);
     }
     
-    size_t local_mat_id = std::distance(m_data.material_ids.begin(), find(m_data.material_ids.begin(), m_data.material_ids.end(), mat_idx));
-    
-    if (local_mat_id == m_data.material_ids.size()) {
-      m_data.material_ids.push_back((int)mat_idx);
+    if (m_data.material_remap.size() < mat_info.mats.size()) {
+      m_data.material_remap.resize(mat_info.mats.size(), -1);
     }
-    
-    if (mesh) {
-      // 0 is defefault material
-      auto eu_material = mesh_import->get_material((int)mat_idx);
-      mesh_import->apply_material(mesh, eu_material.get());
+    if (m_data.material_remap[mat_idx] < 0) {
+      m_data.material_remap[mat_idx] = (int32_t)m_data.material_ids.size();
+      m_data.material_ids.push_back((int)mat_idx);
+      // first face using this material, extend the mesh palette so local ids index into mesh->materials
+      if (mesh) {
+        // 0 is defefault material
+        auto eu_material = mesh_import->get_material((int)mat_idx);
+        mesh_import->apply_material(mesh, eu_material.get());
+      }
     }
-    
-    
-    // Get a uv helper
-    float inv_ss = 1.0f;
-    float inv_tt = 1.0f;
+    tessellated.local_mat_id = m_data.material_remap[mat_idx];
+    tessellated.back = prefer_back_face;
     
     if (!has_face_material) {
-      inv_ss = mat_info.texST[mat_idx].x;
-      inv_tt = mat_info.texST[mat_idx].y;
+      tessellated.inv_ss = (float)mat_info.texST[mat_idx].x;
+      tessellated.inv_tt = (float)mat_info.texST[mat_idx].y;
     }
-    // Find out how many loops the face has
-    size_t num_loops = 0;
-    SU_CALL(SUFaceGetNumInnerLoops(face, &num_loops));
-    num_loops++;  // add the outer loop
-    
-    // If this is a complex face with one or more holes in it
-    // we tessellate it into triangles using the polygon mesh class, then
-    // export each triangle as a face.
-    // info.has_single_loop_ = false;
     
     // Create a mesh from face.
-    SUMeshHelperRef mesh_ref = SU_INVALID;
-    SU_CALL(SUMeshHelperCreateWithTextureWriter(&mesh_ref, face, texture_writer));
-    
-    // Get the vertices
-    size_t num_vertices = 0;
-    SU_CALL(SUMeshHelperGetNumVertices(mesh_ref, &num_vertices));
-    if (num_vertices == 0)
-      return;
-    
-    std::vector<SUPoint3D> vertices(num_vertices);
-    SU_CALL(SUMeshHelperGetVertices(mesh_ref, num_vertices, &vertices[0], &num_vertices));
-    
-    std::vector<SUVector3D> normals(num_vertices);
-    SU_CALL(SUMeshHelperGetNormals(mesh_ref, num_vertices, &normals[0], &num_vertices));
-    std::vector<SUPoint3D> stq_coords(num_vertices);
-    size_t                 uv_size = 0;
+    SU_CALL(SUMeshHelperCreateWithTextureWriter(&tessellated.mesh_ref, face, texture_writer));
+    SU_CALL(SUMeshHelperGetNumVertices(tessellated.mesh_ref, &tessellated.num_vertices));
+    if (tessellated.num_vertices == 0) {
+      SUMeshHelperRelease(&tessellated.mesh_ref);
+      tessellated.mesh_ref = SU_INVALID;
+      return tessellated;
+    }
+    SU_CALL(SUMeshHelperGetNumTriangles(tessellated.mesh_ref, &tessellated.num_triangles));
+    return tessellated;
+  }
+  
+  // extracts a face tessellated by TessellateFace into m_data and releases its helper. scratch and
+  // the m_data buffers must already hold the face
+  static void WriteFace(SUTessellatedFace&     tessellated,
+                        SUPolyInfo&            m_data,
+                        SUFaceScratch&         scratch,
+                        const Eigen::Affine3f& transform,
+                        const Eigen::Matrix3f& normal_transform) {
+    SUMeshHelperRef mesh_ref = tessellated.mesh_ref;
+    size_t num_vertices = tessellated.num_vertices;
+    const size_t num_triangles = tessellated.num_triangles;
+    const float inv_ss = tessellated.inv_ss;
+    const float inv_tt = tessellated.inv_tt;
+    const bool prefer_back_face = tessellated.back;
+    SU_CALL(SUMeshHelperGetVertices(mesh_ref, num_vertices, scratch.vertices.data(), &num_vertices));
+    SU_CALL(SUMeshHelperGetNormals(mesh_ref, num_vertices, scratch.normals.data(), &num_vertices));
+    size_t uv_size = 0;
     if (!prefer_back_face) {
-      SUMeshHelperGetFrontSTQCoords(mesh_ref, num_vertices, &stq_coords[0], &uv_size);
+      SUMeshHelperGetFrontSTQCoords(mesh_ref, num_vertices, scratch.stq_coords.data(), &uv_size);
     } else {
-      SUMeshHelperGetBackSTQCoords(mesh_ref, num_vertices, &stq_coords[0], &uv_size);
+      SUMeshHelperGetBackSTQCoords(mesh_ref, num_vertices, scratch.stq_coords.data(), &uv_size);
     }
     
-    std::vector<float> vertex_positions(num_vertices * 3);
-    std::vector<float> vertex_normal(num_vertices * 3);
+    // Get triangle indices.
+    const size_t num_indices = 3 * num_triangles;
+    size_t       num_retrieved = 0;
+    SU_CALL(SUMeshHelperGetVertexIndices(mesh_ref, num_indices, scratch.indices.data(), &num_retrieved));
+    SUMeshHelperRelease(&tessellated.mesh_ref);
+    tessellated.mesh_ref = SU_INVALID;
+    
+    // extract straight into the destination buffers
+    size_t base_idx = m_data.vertex_positions.size() / 3;
+    m_data.vertex_positions.resize((base_idx + num_vertices) * 3);
+    m_data.vertex_normals.resize((base_idx + num_vertices) * 3);
+    float* vertex_positions = &m_data.vertex_positions[base_idx * 3];
+    float* vertex_normal = &m_data.vertex_normals[base_idx * 3];
     
     // dimension is Y up
     for (size_t i = 0; i < num_vertices; ++i) {
-      Eigen::Vector3f pos(vertices[i].x, vertices[i].y, vertices[i].z);
-      Eigen::Vector3f norm(normals[i].x, normals[i].y, normals[i].z);
-      Eigen::Vector3f post_trans = transform * pos;
-      Eigen::Vector3f norm_trans = normal_transform * norm;
+      const SUPoint3D&  vertex = scratch.vertices[i];
+      const SUVector3D& normal = scratch.normals[i];
+      Eigen::Vector3f   pos(vertex.x, vertex.y, vertex.z);
+      Eigen::Vector3f   norm(normal.x, normal.y, normal.z);
+      Eigen::Vector3f   post_trans = transform * pos;
+      Eigen::Vector3f   norm_trans = normal_transform * norm;
       norm_trans.normalize();
       
       vertex_positions[i * 3 + 0] = post_trans.x();
@@ -342,55 +520,345 @@ using namespace trisetra;
       vertex_normal[i * 3 + 2] = norm_trans.z();
     }
     
-    // Get triangle indices.
-    size_t num_triangles = 0;
-    SU_CALL(SUMeshHelperGetNumTriangles(mesh_ref, &num_triangles));
-    const size_t        num_indices = 3 * num_triangles;
-    size_t              num_retrieved = 0;
-    std::vector<size_t> indices(num_indices);
-    SU_CALL(SUMeshHelperGetVertexIndices(mesh_ref, num_indices, &indices[0], &num_retrieved));
-    std::vector<uint32_t> dst_idx(num_indices);
-    
-    std::vector<float> uv_coord;
     if (uv_size > 0) {
-      uv_coord.resize(num_vertices * 2);
+      size_t uv_base = m_data.uvs.size();
+      m_data.uvs.resize(uv_base + num_vertices * 2);
+      float* uv_coord = &m_data.uvs[uv_base];
       for (size_t i = 0; i < num_vertices; ++i) {
-        uv_coord[i * 2 + 0] = inv_ss * stq_coords[i].x / stq_coords[i].z;
-        uv_coord[i * 2 + 1] = inv_tt * stq_coords[i].y / stq_coords[i].z;
+        const SUPoint3D& stq = scratch.stq_coords[i];
+        uv_coord[i * 2 + 0] = inv_ss * stq.x / stq.z;
+        uv_coord[i * 2 + 1] = inv_tt * stq.y / stq.z;
       }
     }
     
-    size_t               base_idx = m_data.vertex_positions.size() / 3;
-    std::vector<int32_t> face_materials(num_triangles);
+    size_t idx_base = m_data.vertex_indices.size();
+    m_data.vertex_indices.resize(idx_base + num_indices);
+    uint32_t*     dst_idx = &m_data.vertex_indices[idx_base];
+    const size_t* indices = scratch.indices.data();
+    m_data.face_material.insert(m_data.face_material.end(), num_triangles, tessellated.local_mat_id);
     
-    front = !prefer_back_face;
+    bool front = !prefer_back_face;
     for (size_t i_triangle = 0; i_triangle < num_triangles; i_triangle++) {
-      face_materials[i_triangle] = (int)local_mat_id;
       // Three points in each triangle
       if (front) {
         for (size_t i = 0; i < 3; i++) {
           size_t index = indices[i_triangle * 3 + i];
-          dst_idx[i_triangle * 3 + i] = (int)(index + base_idx);
+          dst_idx[i_triangle * 3 + i] = (uint32_t)(index + base_idx);
         }
       } else {
         // back face
         size_t index0 = indices[i_triangle * 3 + 0];
         size_t index1 = indices[i_triangle * 3 + 1];
         size_t index2 = indices[i_triangle * 3 + 2];
-        dst_idx[i_triangle * 3 + 0] = (int)(index2 + base_idx);
-        dst_idx[i_triangle * 3 + 1] = (int)(index1 + base_idx);
-        dst_idx[i_triangle * 3 + 2] = (int)(index0 + base_idx);
+        dst_idx[i_triangle * 3 + 0] = (uint32_t)(index2 + base_idx);
+        dst_idx[i_triangle * 3 + 1] = (uint32_t)(index1 + base_idx);
+        dst_idx[i_triangle * 3 + 2] = (uint32_t)(index0 + base_idx);
       }
     }
-    // combine to original array
+  }
+  
+  // extracts all faces of entities, untransformed, into a new MeshSource
+  static MeshSource* WriteMeshSource(SUEntitiesRef      entities,
+                                     size_t             num_faces,
+                                     SUTextureWriterRef texture_writer,
+                                     SUImportInfo&      mat_info,
+                                     int                parent_idx,
+                                     SUMaterialRef      material,
+                                     bool               instanced,
+                                     MeshImport*        mesh_import,
+                                     const std::string& name) {
+    auto        mesh = mesh_import->create_mesh(name);
+    MeshSource* mesh_node = mesh.get();
+    mesh_import->add_face_descriptor(mesh_node, {3});
     
-    m_data.vertex_positions.insert(m_data.vertex_positions.end(), vertex_positions.begin(), vertex_positions.end());
-    m_data.vertex_normals.insert(m_data.vertex_normals.end(), vertex_normal.begin(), vertex_normal.end());
-    m_data.vertex_indices.insert(m_data.vertex_indices.end(), dst_idx.begin(), dst_idx.end());
-    m_data.face_material.insert(m_data.face_material.end(), face_materials.begin(), face_materials.end());
+    std::vector<SUFaceRef> faces(num_faces);
+    SU_CALL(SUEntitiesGetFaces(entities, num_faces, &faces[0], &num_faces));
     
-    if (uv_size > 0) {
-      m_data.uvs.insert(m_data.uvs.end(), uv_coord.begin(), uv_coord.end());
+    Eigen::Affine3f identity = Eigen::Affine3f::Identity();
+    SUPolyInfo      front_mesh;
+    // tessellate every face first, its counts size the destination and scratch buffers exactly,
+    // so the extraction pass runs without allocating
+    SUTessellation tessellation;
+    tessellation.faces.reserve(num_faces);
+    size_t total_vertices = 0;
+    size_t total_triangles = 0;
+    size_t max_vertices = 0;
+    size_t max_triangles = 0;
+    for (size_t i = 0; i < num_faces; i++) {
+      tessellation.faces.push_back(TessellateFace(faces[i], texture_writer, front_mesh, mat_info, material, mesh_import, mesh_node));
+      const SUTessellatedFace& face = tessellation.faces.back();
+      total_vertices += face.num_vertices;
+      total_triangles += face.num_triangles;
+      max_vertices = std::max(max_vertices, face.num_vertices);
+      max_triangles = std::max(max_triangles, face.num_triangles);
+    }
+    SUFaceScratch& scratch = mat_info.scratch;
+    if (scratch.vertices.size() < max_vertices) {
+      scratch.vertices.resize(max_vertices);
+      scratch.normals.resize(max_vertices);
+      scratch.stq_coords.resize(max_vertices);
+    }
+    if (scratch.indices.size() < max_triangles * 3)
+      scratch.indices.resize(max_triangles * 3);
+    front_mesh.vertex_positions.reserve(total_vertices * 3);
+    front_mesh.vertex_normals.reserve(total_vertices * 3);
+    front_mesh.uvs.reserve(total_vertices * 2);
+    front_mesh.vertex_indices.reserve(total_triangles * 3);
+    front_mesh.face_material.reserve(total_triangles);
+    for (SUTessellatedFace& face : tessellation.faces) {
+      if (SUIsValid(face.mesh_ref))
+        WriteFace(face, front_mesh, scratch, identity, identity.linear());
+    }
+    
+    mesh_import->add_positions(mesh_node, std::move(front_mesh.vertex_positions), std::move(front_mesh.vertex_indices));
+    mesh_import->add_normals(mesh_node, std::move(front_mesh.vertex_normals), {});
+    mesh_import->add_uv(mesh_node, 0, std::move(front_mesh.uvs), {});
+    mesh_import->add_face_material_idx(mesh_node, std::move(front_mesh.face_material));
+    return mesh_node;
+  }
+  
+  // content hash of everything WriteMeshSource reads from a definition: the loops of every face,
+  // front, back and inherited material (by name, with texture scale) and the UVs of textured faces.
+  // the queries are cheap next to tessellation, so unchanged definitions are recognized without extracting them
+  static uint64_t DefinitionHash(SUEntitiesRef      entities,
+                                 size_t             num_faces,
+                                 SUTextureWriterRef texture_writer,
+                                 const SUImportInfo& mat_info,
+                                 SUMaterialRef      material) {
+    std::vector<char> content;
+    auto append = [&content](const void* data, size_t size) {
+      content.insert(content.end(), (const char*)data, (const char*)data + size);
+    };
+    // returns whether the material carries a texture
+    auto append_material = [&](SUMaterialRef ref) {
+      long mat_idx = 0;
+      auto find_mat_it = mat_info.mat_index.find(ref.ptr);
+      if (find_mat_it != mat_info.mat_index.end())
+        mat_idx = find_mat_it->second;
+      const std::string& name = mat_info.names[mat_idx];
+      uint64_t length = name.size();
+      bool textured = SUIsValid(mat_info.textures[mat_idx]);
+      append(&length, sizeof(length));
+      append(name.data(), name.size());
+      append(&textured, sizeof(textured));
+      append(&mat_info.texST[mat_idx], sizeof(SUPoint2D));
+      return textured;
+    };
+    
+    const char tag[] = "definition:1";
+    append(tag, sizeof(tag));
+    bool inherited_texture = append_material(material);
+    
+    std::vector<SUFaceRef> faces(num_faces);
+    SU_CALL(SUEntitiesGetFaces(entities, num_faces, &faces[0], &num_faces));
+    std::vector<SULoopRef>   loops;
+    std::vector<SUVertexRef> vertices;
+    std::vector<SUPoint3D>   points;
+    for (SUFaceRef face : faces) {
+      SUMaterialRef front_material = SU_INVALID;
+      SUMaterialRef back_material = SU_INVALID;
+      SUFaceGetFrontMaterial(face, &front_material);
+      SUFaceGetBackMaterial(face, &back_material);
+      bool front_texture = append_material(front_material);
+      bool back_texture = append_material(back_material);
+      
+      size_t num_inner = 0;
+      SU_CALL(SUFaceGetNumInnerLoops(face, &num_inner));
+      loops.resize(num_inner + 1);
+      SU_CALL(SUFaceGetOuterLoop(face, &loops[0]));
+      if (num_inner > 0)
+        SU_CALL(SUFaceGetInnerLoops(face, num_inner, &loops[1], &num_inner));
+      points.clear();
+      for (size_t l = 0; l < num_inner + 1; ++l) {
+        size_t num_vertices = 0;
+        SU_CALL(SULoopGetNumVertices(loops[l], &num_vertices));
+        vertices.resize(num_vertices);
+        if (num_vertices > 0)
+          SU_CALL(SULoopGetVertices(loops[l], num_vertices, &vertices[0], &num_vertices));
+        uint64_t count = num_vertices;
+        append(&count, sizeof(count));
+        for (size_t v = 0; v < num_vertices; ++v) {
+          SUPoint3D point;
+          SU_CALL(SUVertexGetPosition(vertices[v], &point));
+          points.push_back(point);
+        }
+        append(points.data() + points.size() - num_vertices, num_vertices * sizeof(SUPoint3D));
+      }
+      
+      if (front_texture || back_texture || inherited_texture) {
+        SUUVHelperRef uv_helper = SU_INVALID;
+        if (SUFaceGetUVHelper(face, true, true, texture_writer, &uv_helper) == SU_ERROR_NONE) {
+          for (const SUPoint3D& point : points) {
+            SUUVQ front_uvq = {0.0, 0.0, 0.0};
+            SUUVQ back_uvq = {0.0, 0.0, 0.0};
+            SUUVHelperGetFrontUVQ(uv_helper, &point, &front_uvq);
+            SUUVHelperGetBackUVQ(uv_helper, &point, &back_uvq);
+            append(&front_uvq, sizeof(front_uvq));
+            append(&back_uvq, sizeof(back_uvq));
+          }
+          SUUVHelperRelease(&uv_helper);
+        }
+      }
+    }
+    return hash64(content.data(), content.size());
+  }
+  
+  // rebuilds stored definition geometry, null if the model no longer has one of its materials
+  static MeshSource* RestoreDefinition(StoredDefinition&& stored, const SUImportInfo& mat_info, MeshImport* mesh_import, const std::string& name) {
+    std::vector<int> palette;
+    for (const std::string& material_name : stored.materials) {
+      auto material = mat_info.material_by_name.find(material_name);
+      if (material == mat_info.material_by_name.end())
+        return nullptr;
+      palette.push_back(material->second);
+    }
+    auto        mesh = mesh_import->create_mesh(name);
+    MeshSource* mesh_node = mesh.get();
+    mesh_import->add_face_descriptor(mesh_node, {3});
+    for (int mat_idx : palette)
+      mesh_import->apply_material(mesh_node, mesh_import->get_material(mat_idx).get());
+    mesh_import->add_positions(mesh_node, std::move(stored.pos), std::move(stored.index));
+    mesh_import->add_normals(mesh_node, std::move(stored.normal), {});
+    mesh_import->add_uv(mesh_node, 0, std::move(stored.uv), {});
+    mesh_import->add_face_material_idx(mesh_node, std::move(stored.face_material_idx));
+    return mesh_node;
+  }
+  
+  // local geometry of a definition, taken from the definition store when its content is unchanged
+  // since an earlier run, otherwise extracted through the API and stored for the next one
+  static MeshSource* ExtractDefinition(SUEntitiesRef      entities,
+                                       size_t             num_faces,
+                                       SUTextureWriterRef texture_writer,
+                                       SUImportInfo&      mat_info,
+                                       int                parent_idx,
+                                       SUMaterialRef      material,
+                                       bool               instanced,
+                                       MeshImport*        mesh_import,
+                                       const std::string& name) {
+    if (!mat_info.definition_store)
+      return WriteMeshSource(entities, num_faces, texture_writer, mat_info, parent_idx, material, instanced, mesh_import, name);
+    
+    uint64_t         key = DefinitionHash(entities, num_faces, texture_writer, mat_info, material);
+    StoredDefinition stored;
+    if (mat_info.definition_store->load(key, stored)) {
+      if (MeshSource* mesh = RestoreDefinition(std::move(stored), mat_info, mesh_import, name)) {
+        ++mat_info.definitions_reused;
+        return mesh;
+      }
+    }
+    
+    ++mat_info.definitions_extracted;
+    MeshSource* mesh = WriteMeshSource(entities, num_faces, texture_writer, mat_info, parent_idx, material, instanced, mesh_import, name);
+    stored.pos = mesh->pos;
+    stored.normal = mesh->normal;
+    stored.uv = mesh->uv;
+    stored.index = mesh->index;
+    stored.materials.clear();
+    for (const MaterialData* palette_material : mesh->materials)
+      stored.materials.push_back(palette_material->name);
+    stored.face_material_idx = mesh->face_material_idx;
+    try {
+      mat_info.definition_store->save(key, stored);
+    } catch (const std::exception& e) {
+      std::cerr << name << ": definition not stored, " << e.what() << std::endl;
+    }
+    return mesh;
+  }
+  
+  // bake matrices of mirrored instances only differ by float noise, quantize them so equal mirrors share a key
+  static std::array<int32_t, 9> MirrorKey(const Eigen::Affine3f& to_bake) {
+    std::array<int32_t, 9> key;
+    for (int i = 0; i < 9; ++i) {
+      key[i] = (int32_t)std::lround(to_bake.linear()(i % 3, i / 3) * 1.0e4f);
+    }
+    return key;
+  }
+  
+  // derives the baked copy of already extracted local geometry, the bake matrix has a negative
+  // determinant so the triangle winding is flipped to keep faces pointing outwards
+  static MeshSource* BakeMeshSource(const MeshSource& src, MeshImport* mesh_import, const std::string& name, const Eigen::Affine3f& to_bake) {
+    auto        mesh = mesh_import->create_mesh(name);
+    MeshSource* mesh_node = mesh.get();
+    mesh_import->add_face_descriptor(mesh_node, {3});
+    
+    Eigen::Matrix3f    normal_transform = ((to_bake.linear()).inverse()).transpose();
+    size_t             num_vertices = src.pos.size() / 3;
+    std::vector<float> vertex_positions(src.pos.size());
+    std::vector<float> vertex_normals(src.normal.size());
+    for (size_t i = 0; i < num_vertices; ++i) {
+      Eigen::Vector3f post_trans = to_bake * Eigen::Vector3f(src.pos[i * 3 + 0], src.pos[i * 3 + 1], src.pos[i * 3 + 2]);
+      Eigen::Vector3f norm_trans = normal_transform * Eigen::Vector3f(src.normal[i * 3 + 0], src.normal[i * 3 + 1], src.normal[i * 3 + 2]);
+      norm_trans.normalize();
+      
+      vertex_positions[i * 3 + 0] = post_trans.x();
+      vertex_positions[i * 3 + 1] = post_trans.y();
+      vertex_positions[i * 3 + 2] = post_trans.z();
+      vertex_normals[i * 3 + 0] = norm_trans.x();
+      vertex_normals[i * 3 + 1] = norm_trans.y();
+      vertex_normals[i * 3 + 2] = norm_trans.z();
+    }
+    
+    std::vector<uint32_t> indices(src.index.size());
+    for (size_t i_triangle = 0; i_triangle < src.index.size() / 3; ++i_triangle) {
+      indices[i_triangle * 3 + 0] = src.index[i_triangle * 3 + 2];
+      indices[i_triangle * 3 + 1] = src.index[i_triangle * 3 + 1];
+      indices[i_triangle * 3 + 2] = src.index[i_triangle * 3 + 0];
+    }
+    
+    for (const MaterialData* material : src.materials) {
+      mesh_import->apply_material(mesh_node, material);
+    }
+    mesh_import->add_positions(mesh_node, std::move(vertex_positions), std::move(indices));
+    mesh_import->add_normals(mesh_node, std::move(vertex_normals), {});
+    mesh_import->add_uv(mesh_node, 0, std::vector<float>(src.uv), {});
+    mesh_import->add_face_material_idx(mesh_node, std::vector<int32_t>(src.face_material_idx));
+    return mesh_node;
+  }
+  
+  // links the geometry shared by all instances of a definition (component or group) to node.
+  // def_key identifies the definition, its local geometry is extracted on first use with each inherited material.
+  static void LinkDefinitionMesh(void*                  def_key,
+                                 SUEntitiesRef          entities,
+                                 size_t                 num_faces,
+                                 SUTextureWriterRef     texture_writer,
+                                 SUImportInfo&          mat_info,
+                                 int                    parent_idx,
+                                 SUMaterialRef          material,
+                                 bool                   instanced,
+                                 MeshImport*            mesh_import,
+                                 Node*                  node,
+                                 const std::string&     def_name,
+                                 const Eigen::Affine3f& to_bake) {
+    bool need_baking = !to_bake.matrix().isIdentity();
+    
+    // local (unbaked) geometry of the definition is extracted once and shared
+    MeshSource* local_mesh = nullptr;
+    auto        local_key = std::make_pair(def_key, material.ptr);
+    auto        eu_mesh = mat_info.def_map.find(local_key);
+    if (eu_mesh != mat_info.def_map.end()) {
+      local_mesh = eu_mesh->second;
+      ++mat_info.def_cache_hits;
+    } else {
+      ++mat_info.def_cache_misses;
+      local_mesh = ExtractDefinition(entities, num_faces, texture_writer, mat_info, parent_idx, material, instanced, mesh_import, def_name);
+      mat_info.def_map[local_key] = local_mesh;
+    }
+    
+    if (!need_baking) {
+      mesh_import->add_mesh_to_node(node, local_mesh);
+    } else {
+      // negative scale, link the mirrored variant derived from the local geometry
+      auto mirror_key = std::make_pair(local_key, MirrorKey(to_bake));
+      auto mirror_mesh = mat_info.mirror_map.find(mirror_key);
+      if (mirror_mesh != mat_info.mirror_map.end()) {
+        ++mat_info.mirror_cache_hits;
+        mesh_import->add_mesh_to_node(node, mirror_mesh->second);
+      } else {
+        ++mat_info.mirror_cache_misses;
+        MeshSource* baked = BakeMeshSource(*local_mesh, mesh_import, def_name + "_mirrored", to_bake);
+        mat_info.mirror_map[mirror_key] = baked;
+        mesh_import->add_mesh_to_node(node, baked);
+      }
     }
   }
   
@@ -431,7 +899,6 @@ using namespace trisetra;
         Eigen::Affine3f to_transform;
         Eigen::Affine3f to_bake;
         std::tie(to_transform, to_bake) = DecomposeTransform(src_affine);
-        bool need_baking = !to_bake.matrix().isIdentity();
         auto sanitized_transform = EigenToVector(bake_transform * to_transform);
         //-----------------------------------------------------------------------------
         
@@ -444,51 +911,11 @@ using namespace trisetra;
         SUMaterialRef material = SU_INVALID;
         SUDrawingElementGetMaterial(SUComponentInstanceToDrawingElement(instance), &material);
         if (num_faces > 0) {
-          MeshSource* mesh_node = nullptr;
-          auto                  eu_mesh = mat_info.def_map.find(definition.ptr);
-          if ((eu_mesh == mat_info.def_map.end()) || need_baking) {
-            auto mesh = mesh_import->create_mesh(def_name);
-            // only sotre into map if we dont need baking
-            if (!need_baking)
-              mat_info.def_map[definition.ptr] = mesh.get();
-            mesh_node = mesh.get();
-            mesh_import->add_face_descriptor(mesh_node, {3});
-            mesh_import->add_mesh_to_node(instance_node.get(), mesh_node);
-          } else {
-            // hook up instance.
-            mesh_import->add_mesh_to_node(instance_node.get(), eu_mesh->second);
-          }
-          
-          std::vector<SUFaceRef> faces(num_faces);
-          SU_CALL(SUEntitiesGetFaces(entity_from_def, num_faces, &faces[0], &num_faces));
-          
           if (SUIsValid(material) == false) {
             material = parent_mat;
           }
           
-          SUPolyInfo front_mesh;
-          auto       normal_transform = ((to_bake.linear()).inverse()).transpose();
-          for (size_t i = 0; i < num_faces; i++) {
-            WriteFace(faces[i],
-                      texture_writer,
-                      front_mesh,
-                      mat_info,
-                      parent_idx,
-                      true,
-                      material,
-                      true,
-                      mesh_import,
-                      mesh_node,
-                      to_bake,
-                      normal_transform);
-          }
-          
-          if (mesh_node) {
-            mesh_import->add_positions(mesh_node, std::move(front_mesh.vertex_positions), std::move(front_mesh.vertex_indices));
-            mesh_import->add_normals(mesh_node, std::move(front_mesh.vertex_normals), {});
-            mesh_import->add_uv(mesh_node, 0, std::move(front_mesh.uvs), {});
-            mesh_import->add_face_material_idx(mesh_node, std::move(front_mesh.face_material));
-          }
+          LinkDefinitionMesh(definition.ptr, entity_from_def, num_faces, texture_writer, mat_info, parent_idx, material, true, mesh_import, instance_node.get(), def_name, to_bake);
         }
         
         WriteEntities(entity_from_def, texture_writer, group, mat_info, -1, material, mesh_import, instance_node.get(), to_bake);
@@ -545,37 +972,13 @@ using namespace trisetra;
         }
         
         if (num_faces > 0) {
-          auto mesh = mesh_import->create_mesh(name.utf8());
-          mesh_import->add_face_descriptor(mesh.get(), {3});
-          mesh_import->add_mesh_to_node(instance_node.get(), mesh.get());
-          
-          std::vector<SUFaceRef> faces(num_faces);
-          SU_CALL(SUEntitiesGetFaces(group_entities, num_faces, &faces[0], &num_faces));
           if (SUIsInvalid(material))
             material = parent_mat;
-          SUPolyInfo front_mesh;
-          auto       normal_transform = ((to_bake.linear()).inverse()).transpose();
-          for (size_t i = 0; i < num_faces; i++) {
-            WriteFace(faces[i],
-                      texture_writer,
-                      front_mesh,
-                      mat_info,
-                      parent_idx,
-                      true,
-                      material,
-                      false,
-                      mesh_import,
-                      mesh.get(),
-                      to_bake,
-                      normal_transform);
-          }
-          
-          if (mesh.get()) {
-            mesh_import->add_positions(mesh.get(), std::move(front_mesh.vertex_positions), std::move(front_mesh.vertex_indices));
-            mesh_import->add_normals(mesh.get(), std::move(front_mesh.vertex_normals), {});
-            mesh_import->add_uv(mesh.get(), 0, std::move(front_mesh.uvs), {});
-            mesh_import->add_face_material_idx(mesh.get(), std::move(front_mesh.face_material));
-          }
+          // copies of a group share one group definition, fall back to the group itself if there is none
+          SUComponentDefinitionRef group_def = SU_INVALID;
+          SUComponentInstanceGetDefinition(SUGroupToComponentInstance(group), &group_def);
+          void* def_key = SUIsValid(group_def) ? group_def.ptr : group.ptr;
+          LinkDefinitionMesh(def_key, group_entities, num_faces, texture_writer, mat_info, parent_idx, material, false, mesh_import, instance_node.get(), name.utf8(), to_bake);
         }
         
         // Write entities
@@ -584,21 +987,48 @@ using namespace trisetra;
     }
   }
   
-  void load_skp(const std::string& path, MeshImport* mesh_import) {
-    // Always initialize the API before using it
-    SUInitialize();
-    
-    // Load the model from a file
+  // initializes the API for the lifetime of the scope, one scope covers any number of loads
+  struct SUApiScope {
+    SUApiScope() { SUInitialize(); }
+    ~SUApiScope() { SUTerminate(); }
+  };
+  
+  // releases the model however load_skp leaves
+  struct SUModelGuard {
     SUModelRef model = SU_INVALID;
-    SUResult   res = SUModelCreateFromFile(&model, path.c_str());
+    ~SUModelGuard() {
+      if (SUIsValid(model))
+        SUModelRelease(&model);
+    }
+  };
+  
+  // releases the texture writer however load_skp leaves
+  struct SUTextureWriterGuard {
+    SUTextureWriterRef texture_writer = SU_INVALID;
+    ~SUTextureWriterGuard() {
+      if (SUIsValid(texture_writer))
+        SUTextureWriterRelease(&texture_writer);
+    }
+  };
+  
+  // the API must be initialized by the caller, see SUApiScope. definitions, if given, persists the
+  // geometry of component definitions so a later load of an edited model only extracts what changed.
+  // texture maps are written into texture_dir, see TextureExport. returns what the definition store did
+  DefinitionCounts load_skp(const std::string& path, MeshImport* mesh_import, DefinitionStore* definitions = nullptr,
+                            const std::string& texture_dir = ".") {
+    // Load the model from a file
+    SUModelGuard model_guard;
+    SUResult   res = SUModelCreateFromFile(&model_guard.model, path.c_str());
+    SUModelRef model = model_guard.model;
     
     // It's best to always check the return code from each SU function call.
     // Only showing this check once to keep this example short.
     if (res != SU_ERROR_NONE)
       throw std::runtime_error("SUModelCreateFromFile failed to open: " + path);
     
-    SUTextureWriterRef texture_writer;
-    SU_CALL(SUTextureWriterCreate(&texture_writer));
+    SUTextureWriterGuard texture_writer_guard;
+    SU_CALL(SUTextureWriterCreate(&texture_writer_guard.texture_writer));
+    SUTextureWriterRef texture_writer = texture_writer_guard.texture_writer;
     
     // Get the entity container of the model.
     SUEntitiesRef entities = SU_INVALID;
@@ -616,7 +1046,7 @@ using namespace trisetra;
     
     // with default material
     std::vector<std::shared_ptr<MaterialData>> materials(material_count + 1);
-    ;
+    TextureExport textures(texture_dir);
     for (int i = 0; i < material_count + 1; ++i) {
       materials[i] = std::make_shared<MaterialData>();
     }
@@ -628,6 +1058,10 @@ using namespace trisetra;
       materials[0]->name = "default";
       su_mats.textures[0] = SU_INVALID;
       su_mats.mats[0] = SU_INVALID;
+      su_mats.mat_index.reserve(material_count + 1);
+      for (int i = (int)material_count; i >= 0; --i) {
+        su_mats.mat_index[su_mats.mats[i].ptr] = i;
+      }
       for (int i = 1; i < material_count + 1; ++i) {
         CSUString name;
         SUMaterialGetNameLegacyBehavior(su_mats.mats[i], name);
@@ -647,16 +1081,17 @@ using namespace trisetra;
           SUTextureGetImageRep(texture_ref, &img_rep);
           CSUString tex_name;
           SUTextureGetFileName(texture_ref, tex_name);
-          std::string composed_name = tex_name.utf8() + "_" + name.utf8();
           su_mats.texST[i].x = (float)ss;
           su_mats.texST[i].y = (float)st;
-          AddTextrueToMat(img_rep, materials[i], composed_name );
-          SUImageRepRelease(&img_rep);
+          textures.add(img_rep, tex_name.utf8(), materials[i]);
         }
       }
     }
     
     mesh_import->add_materials(materials);
+    su_mats.definition_store = definitions;
+    for (size_t i = 0; i < material_count + 1; ++i)
+      su_mats.material_by_name.emplace(materials[i]->name, (int)i);
     
     // Get model name
     CSUString name;
@@ -686,35 +1121,8 @@ using namespace trisetra;
     identity.setIdentity();
     SU_CALL(SUEntitiesGetNumFaces(entities, &num_faces));
     if (num_faces > 0) {
-      auto en_mesh = mesh_import->create_mesh("entity");
-      mesh_import->add_face_descriptor(en_mesh.get(), {3});
-      mesh_import->add_mesh_to_node(root_node.get(), en_mesh.get());
-      
-      std::vector<SUFaceRef> faces(num_faces);
-      SU_CALL(SUEntitiesGetFaces(entities, num_faces, &faces[0], &num_faces));
-      
-      SUPolyInfo front_mesh;
-      for (size_t i = 0; i < num_faces; i++) {
-        WriteFace(faces[i],
-                  texture_writer,
-                  front_mesh,
-                  su_mats,
-                  0,
-                  true,
-                  SU_INVALID,
-                  false,
-                  mesh_import,
-                  en_mesh.get(),
-                  identity,
-                  identity.linear());
-      }
-      
-      if (en_mesh.get()) {
-        mesh_import->add_positions(en_mesh.get(), std::move(front_mesh.vertex_positions), std::move(front_mesh.vertex_indices));
-        mesh_import->add_normals(en_mesh.get(), std::move(front_mesh.vertex_normals), {});
-        mesh_import->add_uv(en_mesh.get(), 0, std::move(front_mesh.uvs), {});
-        mesh_import->add_face_material_idx(en_mesh.get(), std::move(front_mesh.face_material));
-      }
+      auto en_mesh = WriteMeshSource(entities, num_faces, texture_writer, su_mats, 0, SU_INVALID, false, mesh_import, "entity");
+      mesh_import->add_mesh_to_node(root_node.get(), en_mesh);
     }
     
     // material gathering
@@ -723,30 +1131,722 @@ using namespace trisetra;
     // Groups
     SUMaterialRef material = SU_INVALID;
     WriteEntities(entities, texture_writer, SU_INVALID, su_mats, 0, material, mesh_import, root_node.get(), identity);
+    std::cout << "definition cache hits:" << su_mats.def_cache_hits << " misses:" << su_mats.def_cache_misses << std::endl;
+    std::cout << "mirrored cache hits:" << su_mats.mirror_cache_hits << " misses:" << su_mats.mirror_cache_misses << std::endl;
+    if (definitions)
+      std::cout << "definition store reused:" << su_mats.definitions_reused << " extracted:" << su_mats.definitions_extracted << std::endl;
+    // definitions whose instances are all mirrored leave their local geometry unlinked
+    mesh_import->remove_unreferenced_meshes();
+    textures.finish();
+    DefinitionCounts counts;
+    counts.reused = su_mats.definitions_reused;
+    counts.extracted = su_mats.definitions_extracted;
+    return counts;
+  }
+  
+  struct ConvertOptions {
+    bool             weld = false;
+    bool             optimize = false;
+    bool             flatten = true;
+    float            rotate = 0.0f;
+    bool             y_up = Y_UP;
+    // outputs go next to the input unless set, texture maps into the working directory unless set
+    std::string      output_dir;
+    // results are looked up and stored here when set
+    ConversionCache* cache = nullptr;
+    // definition geometry persisted across runs when set
+    DefinitionStore* definitions = nullptr;
+    // batch loads run in worker processes instead of threads (--serve always does), a crashed load is
+    // retried this many times
+    bool             processes = false;
+    unsigned         retries = 2;
+    // a worker load running longer than this is taken as hung, killed and retried, 0 waits forever
+    unsigned         timeout = 600;
+    LodOptions       lod_options;
+    SerializeOptions serialize;
+  };
+  
+  struct ConvertResult {
+    std::string input;
+    std::string output;
+    bool        ok = false;
+    std::string error;
+    double      seconds = 0.0;
+    size_t      triangles = 0;
+    size_t      bytes = 0;
+    unsigned    attempts = 1;
+    bool        cached = false;
+    DefinitionCounts definitions;
+    // every file written: outputs, then texture maps
+    std::vector<std::string> files;
+  };
+  
+  static std::string TextureDir(const ConvertOptions& options) {
+    return options.output_dir.empty() ? "." : options.output_dir;
+  }
+  
+  static size_t FileSize(const std::string& path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+  }
+  
+  // the SketchUp API is not documented as thread safe, loads are serialized through this lock
+  // while post processing and writing of other jobs carry on
+  static std::mutex su_api_mutex;
+  
+  // fills the importer with the scene of a .skp and counts what the definition store did,
+  // returns the number of attempts it took
+  typedef std::function<unsigned(const std::string& file_name, const ConvertOptions& options, MeshImporter& mi,
+                                 DefinitionCounts& definitions)> SceneLoader;
+  
+  // loads in this process, the API must be initialized
+  static unsigned LoadInProcess(const std::string& file_name, const ConvertOptions& options, MeshImporter& mi,
+                                DefinitionCounts& definitions) {
+    std::lock_guard<std::mutex> lock(su_api_mutex);
+    definitions = load_skp(file_name, &mi, options.definitions, TextureDir(options));
+    return 1;
+  }
+  
+  // loads in a worker process that hands the scene back through shared memory. a worker that dies
+  // or exceeds timeout is replaced and the load retried up to retries times, so one bad model cannot end the batch.
+  // the job is the texture directory and the input separated by a NUL, which no path contains
+  static unsigned LoadInWorker(std::unique_ptr<WorkerProcess>& worker, const std::string& executable,
+                               const std::string& file_name, const ConvertOptions& options, MeshImporter& mi,
+                               DefinitionCounts& definitions) {
+    std::string crash;
+    std::string job = TextureDir(options) + '\0' + file_name;
+    for (unsigned attempt = 1; attempt <= options.retries + 1; ++attempt) {
+      if (!worker) {
+        std::vector<std::string> arguments;
+        if (options.definitions)
+          arguments = {"--definitions", options.definitions->root(),
+                       "--definitions-size", std::to_string(options.definitions->max_bytes() >> 20)};
+        worker.reset(new WorkerProcess(executable, arguments, options.timeout));
+      }
+      std::string shm_name = unique_shm_name();
+      WorkerReply reply;
+      if (!worker->run(job, shm_name, reply)) {
+        SharedMemory::unlink(shm_name);
+        crash = worker->crash_reason();
+        std::cerr << file_name << ": " << crash << ", attempt " << attempt << std::endl;
+        worker->restart();
+        continue;
+      }
+      if (!reply.ok) {
+        SharedMemory::unlink(shm_name);
+        throw std::runtime_error(reply.error);
+      }
+      SharedMemory shm = SharedMemory::open(shm_name);
+      SharedMemory::unlink(shm_name);
+      if (reply.size > shm.size())
+        throw std::runtime_error("worker reply larger than its shared memory");
+      mi.unpack_scene(shm.data(), (size_t)reply.size);
+      if (reply.counters.size() == 2) {
+        definitions.reused = (size_t)reply.counters[0];
+        definitions.extracted = (size_t)reply.counters[1];
+      }
+      return attempt;
+    }
+    throw std::runtime_error(crash);
+  }
+  
+  // worker process side of LoadInWorker, serves loads until the supervisor goes away
+  static int RunWorker(int in_fd, int out_fd, DefinitionStore* definitions) {
+    SUApiScope api;
+    return serve_worker(in_fd, out_fd, [&](const std::string& job, const std::string& shm_name) {
+      WorkerReply reply;
+      try {
+        size_t split = job.find('\0');
+        if (split == std::string::npos)
+          throw std::runtime_error("worker job without a texture directory");
+        MeshImporter mi;
+        DefinitionCounts counts = load_skp(job.substr(split + 1), &mi, definitions, job.substr(0, split));
+        reply.counters = {counts.reused, counts.extracted};
+        reply.size = mi.pack_scene(nullptr);
+        SharedMemory shm = SharedMemory::create(shm_name, (size_t)reply.size);
+        mi.pack_scene(shm.data());
+        reply.ok = true;
+      } catch (const std::exception& e) {
+        SharedMemory::unlink(shm_name);
+        reply.error = e.what();
+      }
+      return reply;
+    });
+  }
+  
+  // every option that changes the bytes written, hashed into the conversion cache key. the leading
+  // tag must change whenever the writers produce different output for the same options
+  static std::string OptionsDigest(const ConvertOptions& options) {
+    const SerializeOptions& serialize = options.serialize;
+    std::ostringstream digest;
+    digest << std::setprecision(9)
+           << "output:2 container:" << AssetIO::version
+           << " weld:" << options.weld
+           << " optimize:" << options.optimize
+           << " flatten:" << options.flatten
+           << " rotate:" << options.rotate
+           << " y_up:" << options.y_up
+           << " lods:" << options.lod_options.levels << "," << options.lod_options.ratio << "," << options.lod_options.max_error
+           << " ply:" << serialize.ply_ascii << serialize.ply_normals << serialize.ply_uv
+           << " index16:" << serialize.index16
+           << " format:" << (uint32_t)serialize.vertex_format
+           << " v2:" << serialize.tri_v2
+           << " container:" << serialize.container
+           << " compression:" << (uint32_t)serialize.compression;
+    return digest.str();
+  }
+  
+  static void PrintCacheStats(const ConversionCache& cache) {
+    ConversionCache::Stats stats = cache.stats();
+    std::cout << "cache: hits:" << stats.hits << " misses:" << stats.misses
+              << " stored:" << stats.stored << " evicted:" << stats.evicted << std::endl;
+  }
+  
+  // full pipeline for one model, output next to the input or in options.output_dir. with options.cache
+  // a known input and option set is restored from the cache without loading the model
+  static ConvertResult ConvertFile(const std::string& file_name, const ConvertOptions& options, const SceneLoader& loader) {
+    ConvertResult result;
+    result.input = file_name;
+    size_t lastindex = file_name.find_last_of(".");
+    std::string rawname = file_name.substr(0, lastindex);
+    if (!options.output_dir.empty())
+      rawname = options.output_dir + "/" + rawname.substr(rawname.find_last_of('/') + 1);
+    result.output = rawname + (options.serialize.container ? ".tra" : ".tri");
     
-    // Must release the model or there will be memory leaks
-    SUModelRelease(&model);
+    auto start = std::chrono::steady_clock::now();
+    try {
+      uint64_t cache_key = 0;
+      CacheEntry entry;
+      if (options.cache) {
+        cache_key = ConversionCache::key(file_name, OptionsDigest(options));
+        result.cached = options.cache->fetch(cache_key, rawname, TextureDir(options), entry);
+        if (result.cached)
+          result.attempts = 0;
+      }
+      if (!result.cached) {
+        MeshImporter mi;
+        result.attempts = loader(file_name, options, mi, result.definitions);
+        // levels of detail collapse shared positions, copies a weld merges would only hold them back
+        if (options.weld || options.lod_options.levels > 0)
+          mi.weld_vertices(WeldOptions());
+        if (options.lod_options.levels > 0)
+          mi.generate_lods(options.lod_options);
+        // material runs first, the vertex cache order is then optimized within them and written as measured
+        mi.sort_by_material();
+        if (options.optimize)
+          mi.optimize_meshes(32);
+        
+        //mi.serialize_to_file(rawname, true, Y_UP, -1.571f);
+        mi.serialize_to_file(result.output, options.flatten, options.y_up, options.rotate, options.serialize);
+        entry.triangles = mi.triangle_count();
+        entry.files.push_back({CachedFile::Kind::Output, result.output.substr(rawname.size())});
+        if (options.flatten && !options.serialize.container)
+          entry.files.push_back({CachedFile::Kind::Output, ".ply"});
+        for (const std::string& map : mi.texture_maps())
+          entry.files.push_back({CachedFile::Kind::Texture, map});
+        if (options.cache) {
+          try {
+            options.cache->store(cache_key, rawname, TextureDir(options), entry);
+          } catch (const std::exception& e) {
+            std::cerr << file_name << ": not cached, " << e.what() << std::endl;
+          }
+        }
+      }
+      result.triangles = entry.triangles;
+      for (const CachedFile& file : entry.files) {
+        result.files.push_back(file.path(rawname, TextureDir(options)));
+        if (file.kind == CachedFile::Kind::Output)
+          result.bytes += FileSize(result.files.back());
+      }
+      result.ok = true;
+    } catch (const std::exception& e) {
+      result.error = e.what();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+  }
+  
+  static bool EndsWith(const std::string& value, const std::string& suffix) {
+    return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+  
+  // a directory (its .skp files), a manifest (one path per line) or a glob pattern
+  static std::vector<std::string> CollectBatchInputs(const std::string& source) {
+    std::vector<std::string> inputs;
+    struct stat st;
+    if (::stat(source.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      DIR* dir = ::opendir(source.c_str());
+      if (!dir)
+        throw std::runtime_error("failed to open directory: " + source);
+      while (dirent* entry = ::readdir(dir)) {
+        std::string name = entry->d_name;
+        if (EndsWith(name, ".skp"))
+          inputs.push_back(source + "/" + name);
+      }
+      ::closedir(dir);
+    } else if (::stat(source.c_str(), &st) == 0 && !EndsWith(source, ".skp")) {
+      std::ifstream manifest(source);
+      std::string line;
+      while (std::getline(manifest, line)) {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (!line.empty() && line[0] != '#')
+          inputs.push_back(line);
+      }
+    } else {
+      glob_t matches;
+      if (::glob(source.c_str(), 0, nullptr, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; ++i)
+          inputs.push_back(matches.gl_pathv[i]);
+      }
+      ::globfree(&matches);
+    }
+    std::sort(inputs.begin(), inputs.end());
+    return inputs;
+  }
+  
+  // converts every input with at most jobs conversions in flight and writes a tab separated summary.
+  // with options.processes every job slot keeps one worker process (a copy of executable) for its loads
+  static int RunBatch(const std::string& source, unsigned jobs, const std::string& summary_path,
+                      const ConvertOptions& options, const std::string& executable) {
+    std::vector<std::string> inputs = CollectBatchInputs(source);
+    if (inputs.empty()) {
+      // a mistyped directory, glob or manifest must not pass as a successful run
+      std::cerr << "batch: no inputs in " << source << std::endl;
+      return 1;
+    }
+    std::vector<ConvertResult> results(inputs.size());
     
-    // Always terminate the API when done using it
-    SUTerminate();
+    // conversions running side by side split the cores between their weld, LOD, optimize, sort and writer passes
+    unsigned per_job = std::max(1u, worker_count()/std::max(1u, jobs));
+    auto start = std::chrono::steady_clock::now();
+    if (options.processes) {
+      std::atomic<size_t> next(0);
+      parallel_for(std::min<size_t>(jobs, inputs.size()), [&](size_t) {
+        ThreadBudgetScope budget(per_job);
+        std::unique_ptr<WorkerProcess> worker;
+        SceneLoader loader = [&](const std::string& file_name, const ConvertOptions& options, MeshImporter& mi,
+                                 DefinitionCounts& definitions) {
+          return LoadInWorker(worker, executable, file_name, options, mi, definitions);
+        };
+        for (size_t i = next++; i < inputs.size(); i = next++)
+          results[i] = ConvertFile(inputs[i], options, loader);
+      }, 1, jobs);
+    } else {
+      SUApiScope api;
+      parallel_for(inputs.size(), [&](size_t i) {
+        ThreadBudgetScope budget(per_job);
+        results[i] = ConvertFile(inputs[i], options, LoadInProcess);
+      }, 1, jobs);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    std::ofstream summary_file;
+    if (!summary_path.empty())
+      summary_file.open(summary_path);
+    std::ostream& summary = summary_file.is_open() ? summary_file : std::cout;
+    summary << "input\tstatus\tseconds\ttriangles\tbytes\tattempts\tcached\toutput\n";
+    size_t failed = 0;
+    size_t triangles = 0;
+    size_t bytes = 0;
+    DefinitionCounts definitions;
+    for (const ConvertResult& result : results) {
+      summary << result.input << "\t" << (result.ok ? "ok" : "failed") << "\t" << result.seconds << "\t"
+              << result.triangles << "\t" << result.bytes << "\t" << result.attempts << "\t" << result.cached << "\t" << (result.ok ? result.output : result.error) << "\n";
+      failed += result.ok ? 0 : 1;
+      triangles += result.triangles;
+      bytes += result.bytes;
+      definitions.reused += result.definitions.reused;
+      definitions.extracted += result.definitions.extracted;
+    }
+    std::cout << "batch: " << results.size() - failed << "/" << results.size() << " converted in " << seconds << "s"
+              << " triangles:" << triangles << " bytes:" << bytes << std::endl;
+    if (options.definitions)
+      std::cout << "definitions: reused:" << definitions.reused << " extracted:" << definitions.extracted << std::endl;
+    if (options.cache)
+      PrintCacheStats(*options.cache);
+    return failed ? 1 : 0;
   }
 
 
-int main(int argc, const char * argv[]) {
-  // insert code here...
-  MeshImporter mi;
-  if( argc > 1){
-    float rotate = 0.0f;
-    std::string file_name = std::string(argv[1]);
-    if(argc > 2)
-      rotate = std::stof( std::string(argv[2]));
-    load_skp(file_name, &mi );
+// unsigned value of a numeric flag clamped to max, throws unless text is all digits. jobs sent to
+// --serve are untrusted, their values must neither wrap nor size allocations unchecked
+static unsigned ParseCount(const std::string& flag, const std::string& text, unsigned max){
+  if(text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+    throw std::runtime_error(flag + " needs a count, got \"" + text + "\"");
+  unsigned long long value = 0;
+  for(char digit : text)
+    value = std::min<unsigned long long>(value*10 + (unsigned)(digit - '0'), max);
+  return (unsigned)value;
+}
+
+// applies the conversion flag at args[i], shared by the command line and --serve jobs.
+// returns false if args[i] is not a conversion flag, i is left on the flag's last argument
+static bool ParseConvertFlag(const std::vector<std::string>& args, size_t& i, ConvertOptions& convert){
+  SerializeOptions& options = convert.serialize;
+  const std::string& arg = args[i];
+  bool has_value = i + 1 < args.size();
+  if(arg == "--weld")
+    convert.weld = true;
+  else if(arg == "--lods" && has_value)
+    convert.lod_options.levels = ParseCount(arg, args[++i], LodOptions::max_levels);
+  else if(arg == "--optimize")
+    convert.optimize = true;
+  else if(arg == "--instanced")
+    convert.flatten = false;
+  else if(arg == "--v2")
+    options.tri_v2 = true;
+  else if(arg == "--index16")
+    options.index16 = true;
+  else if(arg == "--quantize")
+    options.vertex_format = VertexFormat::Quantized12;
+  else if(arg == "--quantize-hq")
+    options.vertex_format = VertexFormat::Quantized16;
+  else if(arg == "--container")
+    options.container = true;
+  else if(arg == "--compress")
+    options.compression = AssetIO::Compression::Deflate;
+  else if(arg == "--ply-ascii")
+    options.ply_ascii = true;
+  else if(arg == "--ply-normals")
+    options.ply_normals = true;
+  else if(arg == "--ply-uv")
+    options.ply_uv = true;
+  else
+    return false;
+  return true;
+}
+
+static std::string serve_socket_path;
+
+static void StopServer(int){
+  ::unlink(serve_socket_path.c_str());
+  ::_exit(0);
+}
+
+// removes a job's scratch directory and what was written into it
+static void RemoveJobDir(const std::string& dir){
+  if(DIR* handle = ::opendir(dir.c_str())){
+    while(dirent* entry = ::readdir(handle)){
+      std::string name = entry->d_name;
+      if(name != "." && name != "..")
+        ::unlink((dir + "/" + name).c_str());
+    }
+    ::closedir(handle);
+  }
+  ::rmdir(dir.c_str());
+}
+
+// one --serve connection: receives the job, converts into a scratch directory and streams the files back.
+// runs on a detached thread, so nothing may escape it
+static void ServeJob(int fd, const ConvertOptions& defaults, uint64_t max_upload, const SceneLoader& loader){
+  try {
+    ServiceJob job;
+    if(!ConvertService::receive_job(fd, job, max_upload)){
+      ConvertService::send_reply(fd, false, "malformed job or inline data over " + std::to_string(max_upload >> 20) + "MB", {});
+      return;
+    }
     
-    size_t lastindex = file_name.find_last_of(".");
-    std::string rawname = file_name.substr(0, lastindex);
-    rawname = rawname + ".tri";
-    //mi.serialize_to_file(rawname, true, Y_UP, -1.571f);
-    mi.serialize_to_file(rawname, true, Y_UP, rotate);
+    char dir_template[] = "/tmp/trisetra.XXXXXX";
+    if(!::mkdtemp(dir_template)){
+      ConvertService::send_reply(fd, false, "failed to create a scratch directory", {});
+      return;
+    }
+    std::string dir = dir_template;
+    ConvertResult result;
+    try {
+      ConvertOptions options = defaults;
+      options.rotate = job.rotate_z;
+      options.y_up = job.y_up;
+      options.output_dir = dir;
+      for(size_t i = 0; i < job.flags.size(); ++i){
+        if(!ParseConvertFlag(job.flags, i, options))
+          throw std::runtime_error("unknown conversion flag " + job.flags[i]);
+      }
+      std::string input = job.input;
+      if(!job.data.empty()){
+        std::string name = job.input.substr(job.input.find_last_of('/') + 1);
+        input = dir + "/" + (EndsWith(name, ".skp") ? name : "input.skp");
+        std::ofstream file(input, std::ios::binary);
+        file.write(job.data.data(), (std::streamsize)job.data.size());
+        if(!file.flush())
+          throw std::runtime_error("failed to store inline input");
+      }
+      result = ConvertFile(input, options, loader);
+    } catch (const std::exception& e) {
+      result.ok = false;
+      result.error = e.what();
+    }
+    
+    std::vector<ServiceFile> files;
+    for(const std::string& path : result.files)
+      files.push_back({path, path.substr(path.find_last_of('/') + 1)});
+    std::ostringstream summary;
+    summary << "triangles:" << result.triangles << " bytes:" << result.bytes << " seconds:" << result.seconds;
+    ConvertService::send_reply(fd, result.ok, result.ok ? summary.str() : result.error, result.ok ? files : std::vector<ServiceFile>());
+    RemoveJobDir(dir);
+  } catch (const std::exception& e) {
+    std::cerr << "job failed: " << e.what() << std::endl;
+  }
+}
+
+// --serve: converts one job per connection, at most jobs at a time. uploads are untrusted, so every
+// slot loads through its own worker process (a copy of executable): a model that crashes or hangs the
+// SketchUp API only takes down its worker and not the jobs in flight. SIGINT/SIGTERM remove the socket and exit
+static int RunServer(const std::string& socket_path, unsigned jobs, uint64_t max_upload, const ConvertOptions& defaults,
+                     const std::string& executable){
+  int listen_fd = ConvertService::listen(socket_path);
+  serve_socket_path = socket_path;
+  std::signal(SIGINT, StopServer);
+  std::signal(SIGTERM, StopServer);
+  std::cout << "serving on " << socket_path << std::endl;
+  
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned active = 0;
+  // one worker per slot, started on the slot's first job and kept for the next ones
+  std::vector<std::unique_ptr<WorkerProcess>> workers(jobs);
+  std::vector<size_t> free_slots;
+  for(size_t slot = jobs; slot > 0; --slot)
+    free_slots.push_back(slot - 1);
+  for(;;){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]{ return active < jobs; });
+    }
+    int fd = ::accept(listen_fd, nullptr, nullptr);
+    if(fd < 0){
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]{ return active == 0; });
+      return 1;
+    }
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    size_t slot;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++active;
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    std::thread([&, fd, slot]{
+      SceneLoader loader = [&](const std::string& file_name, const ConvertOptions& options, MeshImporter& mi,
+                               DefinitionCounts& definitions) {
+        return LoadInWorker(workers[slot], executable, file_name, options, mi, definitions);
+      };
+      ServeJob(fd, defaults, max_upload, loader);
+      ::close(fd);
+      std::lock_guard<std::mutex> lock(mutex);
+      free_slots.push_back(slot);
+      --active;
+      cv.notify_one();
+    }).detach();
+  }
+}
+
+// --client: sends one job to a --serve daemon and stores the returned files in output_dir
+static int RunClient(const std::string& socket_path, const std::string& input, const ServiceJob& options,
+                     bool send_inline, const std::string& output_dir){
+  ServiceJob job = options;
+  if(send_inline){
+    std::ifstream file(input, std::ios::binary);
+    if(!file){
+      std::cerr << input << ": failed to open" << std::endl;
+      return 1;
+    }
+    job.data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    job.input = input.substr(input.find_last_of('/') + 1);
+  } else {
+    // the daemon resolves paths from its own working directory
+    char resolved[PATH_MAX];
+    job.input = ::realpath(input.c_str(), resolved) ? resolved : input;
+  }
+  
+  int fd = ConvertService::connect(socket_path);
+  ServiceReply reply;
+  bool complete = ConvertService::send_job(fd, job) && ConvertService::receive_reply(fd, output_dir, reply);
+  ::close(fd);
+  if(!complete){
+    std::cerr << input << ": connection to " << socket_path << " lost" << std::endl;
+    return 1;
+  }
+  if(!reply.ok){
+    std::cerr << input << ": " << reply.message << std::endl;
+    return 1;
+  }
+  std::cout << input << ": " << reply.message << std::endl;
+  for(const std::string& file : reply.files)
+    std::cout << "  " << file << std::endl;
+  return 0;
+}
+
+// maps a written .tri and reports its contents and load time
+static void inspect_tri(const std::string& file_name){
+  auto start = std::chrono::steady_clock::now();
+  TriReader reader(file_name, TriReader::Access::Prefault);
+  double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  
+  size_t vertices = 0;
+  size_t indices = 0;
+  size_t ranges = 0;
+  for(const TriMeshView& mesh : reader.meshes()){
+    vertices += mesh.vertex_count;
+    indices += mesh.index_count();
+    ranges += mesh.ranges.size;
+  }
+  std::cout << file_name << ": v" << reader.version()
+            << " format:" << (uint32_t)reader.vertex_format()
+            << " meshes:" << reader.meshes().size()
+            << " nodes:" << reader.nodes().size
+            << " materials:" << reader.materials().size()
+            << " draw ranges:" << ranges
+            << " vertices:" << vertices
+            << " triangles:" << indices/3
+            << " bytes:" << reader.file_size()
+            << " load:" << load_ms << "ms" << std::endl;
+}
+
+int main(int argc, const char * argv[]) {
+  // usage: sketchup_converter <file.skp> [rotate_z] [--y-up] [conversion flags]
+  //        sketchup_converter --batch <dir|glob|manifest> [rotate_z] [--jobs <n>] [--processes] [--retries <n>] [--timeout <seconds>] [--summary <file.tsv>] [conversion flags]
+  //        sketchup_converter --serve <socket> [--jobs <n>] [--max-upload <MB>] [conversion flags as defaults]
+  //        sketchup_converter --client <socket> <file.skp> [rotate_z] [--y-up] [--inline] [--out <dir>] [conversion flags]
+  //        sketchup_converter --inspect <file.tri>
+  // --cache <dir> [--cache-size <MB>] reuses earlier results in single, batch and serve mode
+  // --definitions <dir> [--definitions-size <MB>] keeps extracted component definitions so edited models only
+  //                                             re-extract what changed
+  // conversion flags: [--weld] [--lods <levels> (implies --weld)] [--optimize] [--instanced] [--v2] [--index16] [--quantize] [--quantize-hq]
+  //                   [--container] [--compress] [--ply-ascii] [--ply-normals] [--ply-uv]
+  std::vector<std::string> argl(argv + 1, argv + argc);
+  std::vector<std::string> args;
+  // conversion flags as given, forwarded by --client
+  std::vector<std::string> flags;
+  ConvertOptions convert;
+  convert.lod_options.levels = 0;
+  std::string batch;
+  unsigned jobs = worker_count();
+  std::string summary;
+  std::string serve;
+  std::string client;
+  bool send_inline = false;
+  std::string output_dir = ".";
+  std::string cache_dir;
+  std::string definitions_dir;
+  uint64_t cache_size = 1024;
+  uint64_t definitions_size = 1024;
+  uint64_t max_upload = ConvertService::default_max_data >> 20;
+  // sizes in MB, at most 64 GB uploads and a 16 TB cache or definition store, so the shifts to bytes cannot overflow
+  try {
+    for(size_t i = 0; i < argl.size(); ++i){
+      const std::string& arg = argl[i];
+      bool has_value = i + 1 < argl.size();
+      size_t first = i;
+      if(arg == "--worker" && i + 2 < argl.size()){
+        std::unique_ptr<DefinitionStore> definitions;
+        std::string worker_definitions;
+        uint64_t worker_definitions_size = 1024;
+        for(size_t w = i + 3; w + 1 < argl.size(); w += 2){
+          if(argl[w] == "--definitions")
+            worker_definitions = argl[w + 1];
+          else if(argl[w] == "--definitions-size")
+            worker_definitions_size = ParseCount(argl[w], argl[w + 1], 1u << 24);
+        }
+        if(!worker_definitions.empty())
+          definitions.reset(new DefinitionStore(worker_definitions, worker_definitions_size << 20));
+        return RunWorker(std::stoi(argl[i + 1]), std::stoi(argl[i + 2]), definitions.get());
+      }
+      else if(arg == "--inspect" && has_value){
+        inspect_tri(argl[i + 1]);
+        return 0;
+      }
+      else if(arg == "--batch" && has_value)
+        batch = argl[++i];
+      else if(arg == "--serve" && has_value)
+        serve = argl[++i];
+      else if(arg == "--client" && has_value)
+        client = argl[++i];
+      else if(arg == "--inline")
+        send_inline = true;
+      else if(arg == "--out" && has_value)
+        output_dir = argl[++i];
+      else if(arg == "--jobs" && has_value)
+        jobs = std::max(1u, ParseCount(arg, argl[++i], 1024));
+      else if(arg == "--processes")
+        convert.processes = true;
+      else if(arg == "--retries" && has_value)
+        convert.retries = ParseCount(arg, argl[++i], 100);
+      else if(arg == "--timeout" && has_value)
+        convert.timeout = ParseCount(arg, argl[++i], 7*24*3600);
+      else if(arg == "--summary" && has_value)
+        summary = argl[++i];
+      else if(arg == "--cache" && has_value)
+        cache_dir = argl[++i];
+      else if(arg == "--definitions" && has_value)
+        definitions_dir = argl[++i];
+      else if(arg == "--max-upload" && has_value)
+        max_upload = ParseCount(arg, argl[++i], 1u << 16);
+      else if(arg == "--cache-size" && has_value)
+        cache_size = ParseCount(arg, argl[++i], 1u << 24);
+      else if(arg == "--definitions-size" && has_value)
+        definitions_size = ParseCount(arg, argl[++i], 1u << 24);
+      else if(arg == "--y-up")
+        convert.y_up = true;
+      else if(ParseConvertFlag(argl, i, convert))
+        flags.insert(flags.end(), argl.begin() + first, argl.begin() + i + 1);
+      else
+        args.push_back(arg);
+    }
+  
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<ConversionCache> cache;
+  if(!cache_dir.empty()){
+    cache.reset(new ConversionCache(cache_dir, cache_size << 20));
+    convert.cache = cache.get();
+  }
+  std::unique_ptr<DefinitionStore> definitions;
+  if(!definitions_dir.empty()){
+    definitions.reset(new DefinitionStore(definitions_dir, definitions_size << 20));
+    convert.definitions = definitions.get();
+  }
+  
+  if(!serve.empty())
+    return RunServer(serve, jobs, max_upload << 20, convert, argv[0]);
+  
+  if(!client.empty()){
+    if(args.empty()){
+      std::cerr << "--client needs an input file" << std::endl;
+      return 1;
+    }
+    ServiceJob job;
+    job.rotate_z = args.size() > 1 ? std::stof(args[1]) : 0.0f;
+    job.y_up = convert.y_up;
+    job.flags = flags;
+    return RunClient(client, args[0], job, send_inline, output_dir);
+  }
+  
+  if(!batch.empty()){
+    if(args.size() > 0)
+      convert.rotate = std::stof(args[0]);
+    return RunBatch(batch, jobs, summary, convert, argv[0]);
+  }
+  
+  if( args.size() > 0){
+    std::string file_name = args[0];
+    if(args.size() > 1)
+      convert.rotate = std::stof(args[1]);
+    SUApiScope api;
+    ConvertResult result = ConvertFile(file_name, convert, LoadInProcess);
+    if(!result.ok){
+      std::cerr << file_name << ": " << result.error << std::endl;
+      return 1;
+    }
+    if(cache)
+      PrintCacheStats(*cache);
   }
   
   return 0;